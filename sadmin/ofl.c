@@ -11,8 +11,12 @@
  */
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,29 +25,92 @@
 #include <libHX.h>
 
 /**
- * @sb:		just space
+ * @pid:	process the output is about
+ * @off, @len:	its text in the owning ofl_out's buffer
+ */
+struct ofl_rec {
+	pid_t pid;
+	size_t off, len;
+};
+
+/**
+ * Per-thread output, merged in PID order once all threads are done.
+ * Each process is handled by one thread, so its lines are contiguous.
+ */
+struct ofl_out {
+	char *buf;
+	size_t len, cap;
+	struct ofl_rec *rec;
+	size_t nr_rec, alloc_rec;
+};
+
+/**
+ * @mnt:	path being searched for, without trailing slashes
+ * @mnt_len:	length of @mnt
  * @pid:	pid for current process
+ * @pfd:	directory fd of /proc/<pid>
  * @signal:	signal to send
- * @check:	check for symlink
  * @found:	found something (used for exit value)
+ * @out:	where this thread's output goes
  */
 struct ofl_compound {
-	struct stat sb;
+	const char *mnt;
+	size_t mnt_len;
 	pid_t pid;
+	int pfd;
 	unsigned char signal;
-	bool check, found;
+	bool found;
+	struct ofl_out out;
+};
+
+/**
+ * @pids:	all processes, ascending
+ * @next:	index of the first PID not yet taken by a worker
+ */
+struct ofl_scan {
+	pid_t *pids;
+	size_t nr_pids, next;
 };
 
 static bool pids_only;
+static unsigned int ofl_jobs;
 
-static const char *ofl_comm(pid_t pid, char *buf, size_t size)
+static void ofl_printf(struct ofl_compound *data, const char *fmt, ...)
 {
-	char src[64], dst[512];
+	struct ofl_out *o = &data->out;
+	va_list args;
+	size_t cap;
+	char *nb;
+	int ret;
+
+	while (true) {
+		va_start(args, fmt);
+		ret = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, args);
+		va_end(args);
+		if (ret < 0)
+			return;
+		if (o->len + ret < o->cap) {
+			o->len += ret;
+			return;
+		}
+		cap = o->cap == 0 ? 4096 : 2 * o->cap;
+		while (cap <= o->len + ret)
+			cap *= 2;
+		nb = realloc(o->buf, cap);
+		if (nb == NULL)
+			return;
+		o->buf = nb;
+		o->cap = cap;
+	}
+}
+
+static const char *ofl_comm(int pfd, char *buf, size_t size)
+{
+	char dst[512];
 	const char *p;
 	ssize_t ret;
 
-	snprintf(src, sizeof(src), "/proc/%u/exe", (unsigned int)pid);
-	ret = readlink(src, dst, sizeof(dst) - 1);
+	ret = readlinkat(pfd, "exe", dst, sizeof(dst) - 1);
 	if (ret < 0) {
 		*buf = '\0';
 		return buf;
@@ -56,39 +123,33 @@ static const char *ofl_comm(pid_t pid, char *buf, size_t size)
 
 /**
  * ofl_file - check if file is within directory
- * @mnt:	mountpoint
- * @file:	file that is supposed to be within @mnt
+ * @file:	file that is supposed to be within @data->mnt
+ * @where:	entry in /proc/<pid> that pointed to @file
+ * @name:	entry within @where, or %NULL
  *
  * Returns true if that seems so.
  * We do not check for the existence of @file using lstat() or so - it is
  * assumed this exists if it is found through procfs. In fact,
- * /proc/<pid>/task/<tid>/fd/<n> might point to the ominous
+ * /proc/<pid>/fd/<n> might point to the ominous
  * "/foo/bar (deleted)" which almost never exists, but it shows us anyway that
  * the file is still in use.
  */
-static bool ofl_file(const char *mnt, const char *file, const char *ll_entry,
+static bool ofl_file(const char *file, const char *where, const char *name,
     struct ofl_compound *data)
 {
-	ssize_t mnt_len;
-	const char *p;
-
-	/* Strip extra slashes at the end */
-	mnt_len = strlen(mnt);
-	for (p = mnt + mnt_len - 1; p >= mnt && *p == '/'; --p)
-		--mnt_len;
-
-	if (strncmp(file, mnt, mnt_len) != 0)
+	if (strncmp(file, data->mnt, data->mnt_len) != 0)
 		return false;
-	if (file[mnt_len] != '\0' && file[mnt_len] != '/')
+	if (file[data->mnt_len] != '\0' && file[data->mnt_len] != '/')
 		return false;
 
 	data->found = true;
 	if (pids_only) {
-		printf("%u ", data->pid);
+		ofl_printf(data, "%u ", data->pid);
 	} else if (data->signal == 0) {
 		char buf[24];
-		printf("%u(%s): %s -> %s\n", data->pid,
-		       ofl_comm(data->pid, buf, sizeof(buf)), ll_entry, file);
+		ofl_printf(data, "%u(%s): /proc/%u/%s%s%s -> %s\n", data->pid,
+		       ofl_comm(data->pfd, buf, sizeof(buf)), data->pid, where,
+		       name != NULL ? "/" : "", name != NULL ? name : "", file);
 		return false; /* so that more FDs will be inspected */
 	}
 
@@ -102,20 +163,22 @@ static bool ofl_file(const char *mnt, const char *file, const char *ll_entry,
 
 /**
  * ofl_pmap - read process mappings
- * @mnt:	mountpoint
- * @map_file:	/proc/<pid>/maps
  */
-static bool ofl_pmap(const char *mnt, const char *map_file,
-    struct ofl_compound *data)
+static bool ofl_pmap(struct ofl_compound *data)
 {
 	hxmc_t *line = NULL;
 	bool ret = false;
 	unsigned int i;
 	const char *p;
 	FILE *fp;
+	int fd;
 
-	if ((fp = fopen(map_file, "r")) == NULL)
+	if ((fd = openat(data->pfd, "maps", O_RDONLY)) < 0)
+		return false;
+	if ((fp = fdopen(fd, "r")) == NULL) {
+		close(fd);
 		return false;
+	}
 
 	while (HX_getl(&line, fp) != NULL) {
 		HX_chomp(line);
@@ -128,7 +191,7 @@ static bool ofl_pmap(const char *mnt, const char *map_file,
 		}
 		if (*p == '\0')
 			continue;
-		ret = ofl_file(mnt, p, map_file, data);
+		ret = ofl_file(p, "maps", NULL, data);
 		if (ret)
 			break;
 	}
@@ -140,130 +203,344 @@ static bool ofl_pmap(const char *mnt, const char *map_file,
 
 /**
  * ofl_one - check a symlink
- * @mnt:	Mountpoint that is to be removed.
- * @entry:	Path to a symlink.
+ * @dfd:	directory containing the symlink
+ * @where:	for display, path of @dfd relative to /proc/<pid>
+ * @name:	symlink within @dfd
+ *
+ * There is no need to lstat @name first: readlinkat fails with EINVAL
+ * for anything but a symlink.
  *
  * Returns true if the process does not exist anymore or has been signalled.
  */
-static bool ofl_one(const char *mnt, const char *entry,
+static bool ofl_one(int dfd, const char *where, const char *name,
     struct ofl_compound *data)
 {
 	ssize_t lnk_len;
 	char tmp[512];
 
-	if (data->check)
-		if (lstat(entry, &data->sb) < 0 || !S_ISLNK(data->sb.st_mode))
-			return false;
-
-	lnk_len = readlink(entry, tmp, sizeof(tmp) - 1);
+	lnk_len = readlinkat(dfd, name, tmp, sizeof(tmp) - 1);
 	if (lnk_len < 0)
 		return false;
 	tmp[lnk_len] = '\0';
 
-	return ofl_file(mnt, tmp, entry, data);
+	if (where == NULL)
+		return ofl_file(tmp, name, NULL, data);
+	return ofl_file(tmp, where, name, data);
 }
 
 /**
- * ofl_taskfd - iterate through /proc/<pid>/task/<tid>/fd/
+ * ofl_fddir - iterate through the fd/ directory @where in /proc/<pid>
+ * @seen:	set if the directory had any entries
  */
-static bool ofl_taskfd(const char *mnt, const char *path,
-    struct ofl_compound *data)
+static bool ofl_fddir(const char *where, struct ofl_compound *data,
+    bool *seen)
 {
-	const char *de;
-	char tmp[256];
-	struct HXdir *dir;
+	const struct dirent *de;
 	bool ret = false;
+	DIR *dir;
+	int fd;
 
-	dir = HXdir_open(path);
-	if (dir == NULL)
+	*seen = false;
+	fd = openat(data->pfd, where, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
 		return false;
-	while ((de = HXdir_read(dir)) != NULL) {
-		if (*de == '.')
-			continue;
-		snprintf(tmp, sizeof(tmp), "%s/%s", path, de);
-		if (lstat(tmp, &data->sb) < 0 || !S_ISLNK(data->sb.st_mode))
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return false;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (*de->d_name == '.')
 			continue;
-		ret = ofl_one(mnt, tmp, data);
+		*seen = true;
+		ret = ofl_one(dirfd(dir), where, de->d_name, data);
 		if (ret)
 			break;
 	}
-	HXdir_close(dir);
+	closedir(dir);
 	return ret;
 }
 
 /**
- * ofl_task - iterate through /proc/<pid>/task/
+ * ofl_fds - check all file descriptors of a thread group
+ *
+ * Threads share the descriptor table of the group leader, which
+ * /proc/<pid>/fd shows, so it is read just once rather than once per
+ * task. Only if that is empty or gone (the leader has exited while
+ * other threads live on) are the tasks looked at, and then only until
+ * one of them has a table.
  */
-static void ofl_task(const char *mnt, const char *path,
-    struct ofl_compound *data)
+static bool ofl_fds(struct ofl_compound *data)
+{
+	const struct dirent *de;
+	char where[64];
+	bool ret, seen;
+	DIR *dir;
+	int fd;
+
+	ret = ofl_fddir("fd", data, &seen);
+	if (ret || seen)
+		return ret;
+	fd = openat(data->pfd, "task", O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+		return false;
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		close(fd);
+		return false;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (*de->d_name == '.')
+			continue;
+		snprintf(where, sizeof(where), "task/%.32s/fd", de->d_name);
+		ret = ofl_fddir(where, data, &seen);
+		if (ret || seen)
+			break;
+	}
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * ofl_pid - check one process
+ */
+static void ofl_pid(struct ofl_compound *data)
 {
-	const char *de;
-	char tmp[256];
-	struct HXdir *dir;
+	/* Program map */
+	if (ofl_pmap(data))
+		return;
 
-	dir = HXdir_open(path);
-	if (dir == NULL)
+	/* Basic links */
+	if (ofl_one(data->pfd, NULL, "root", data) ||
+	    ofl_one(data->pfd, NULL, "cwd", data) ||
+	    ofl_one(data->pfd, NULL, "exe", data))
 		return;
-	while ((de = HXdir_read(dir)) != NULL) {
-		if (*de == '.')
-			continue;
-		snprintf(tmp, sizeof(tmp), "%s/%s/fd", path, de);
-		if (lstat(tmp, &data->sb) < 0 || !S_ISDIR(data->sb.st_mode))
-			continue;
-		ofl_taskfd(mnt, tmp, data);
+
+	/* All file descriptors */
+	ofl_fds(data);
+}
+
+/**
+ * ofl_record - note that the output from @start on is about @data->pid
+ */
+static void ofl_record(struct ofl_compound *data, size_t start)
+{
+	struct ofl_out *o = &data->out;
+	struct ofl_rec *nr;
+	size_t na;
+
+	if (o->len == start)
+		return;
+	if (o->nr_rec == o->alloc_rec) {
+		na = o->alloc_rec == 0 ? 64 : 2 * o->alloc_rec;
+		nr = realloc(o->rec, na * sizeof(*nr));
+		if (nr == NULL) {
+			o->len = start;
+			return;
+		}
+		o->rec = nr;
+		o->alloc_rec = na;
 	}
-	HXdir_close(dir);
+	o->rec[o->nr_rec].pid = data->pid;
+	o->rec[o->nr_rec].off = start;
+	o->rec[o->nr_rec].len = o->len - start;
+	++o->nr_rec;
+}
+
+static int ofl_pid_cmp(const void *a, const void *b)
+{
+	pid_t x = *static_cast(const pid_t *, a);
+	pid_t y = *static_cast(const pid_t *, b);
+
+	return (x > y) - (x < y);
 }
 
+/*
+ * Workers take PIDs in consecutive slices of this many, so that each
+ * worker's output is ascending and slow processes do not hold up a
+ * whole static partition.
+ */
+static const size_t ofl_slice = 32;
+
 /**
- * ofl - filesystem use checker
- * @mnt:	mountpoint to search for
- * @action:	action to take
+ * @scan:	the shared PID list
+ * @data:	this worker's state and output
  */
-static bool ofl(const char *mnt, unsigned int signum)
+struct ofl_worker {
+	struct ofl_scan *scan;
+	struct ofl_compound data;
+	pthread_t tid;
+};
+
+static void *ofl_worker_main(void *arg)
 {
-	struct ofl_compound data = {.signal = signum};
-	const char *de;
-	char tmp[256];
-	struct HXdir *dir;
+	struct ofl_worker *w = arg;
+	struct ofl_compound *data = &w->data;
+	struct ofl_scan *scan = w->scan;
+	size_t i, end, start;
+	char name[24];
+	int procfd;
+
+	procfd = open("/proc", O_RDONLY | O_DIRECTORY);
+	if (procfd < 0)
+		return NULL;
+	while ((i = __atomic_fetch_add(&scan->next, ofl_slice,
+	    __ATOMIC_RELAXED)) < scan->nr_pids) {
+		end = i + ofl_slice < scan->nr_pids ? i + ofl_slice :
+		      scan->nr_pids;
+		for (; i < end; ++i) {
+			data->pid = scan->pids[i];
+			snprintf(name, sizeof(name), "%u", data->pid);
+			data->pfd = openat(procfd, name,
+			            O_RDONLY | O_DIRECTORY);
+			if (data->pfd < 0)
+				continue;
+			start = data->out.len;
+			ofl_pid(data);
+			ofl_record(data, start);
+			close(data->pfd);
+		}
+	}
+	close(procfd);
+	return NULL;
+}
+
+/**
+ * ofl_pids - read the list of processes
+ *
+ * Returns the number of PIDs in *@pids, in ascending order.
+ */
+static size_t ofl_pids(pid_t **pids)
+{
+	const struct dirent *de;
+	size_t nr = 0, alloc = 0;
+	pid_t *np, pid;
+	DIR *dir;
 
-	dir = HXdir_open("/proc");
+	*pids = NULL;
+	dir = opendir("/proc");
 	if (dir == NULL)
-		return false;
-	while ((de = HXdir_read(dir)) != NULL) {
-		if (*de == '.')
-			continue;
-		data.pid = strtoul(de, NULL, 0);
-		if (data.pid == 0)
+		return 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (!HX_isdigit(*de->d_name))
 			continue;
-		snprintf(tmp, sizeof(tmp), "/proc/%s", de);
-		if (lstat(tmp, &data.sb) < 0 || !S_ISDIR(data.sb.st_mode))
+		if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
 			continue;
-
-		/* Program map */
-		snprintf(tmp, sizeof(tmp), "/proc/%s/maps", de);
-		if (ofl_pmap(mnt, tmp, &data))
+		pid = strtoul(de->d_name, NULL, 0);
+		if (pid == 0)
 			continue;
+		if (nr == alloc) {
+			alloc = alloc == 0 ? 1024 : 2 * alloc;
+			np = realloc(*pids, alloc * sizeof(*np));
+			if (np == NULL)
+				break;
+			*pids = np;
+		}
+		(*pids)[nr++] = pid;
+	}
+	closedir(dir);
+	/* readdir on /proc is ascending already, but do not rely on it */
+	for (alloc = 1; alloc < nr; ++alloc)
+		if ((*pids)[alloc-1] > (*pids)[alloc])
+			break;
+	if (alloc < nr)
+		qsort(*pids, nr, sizeof(**pids), ofl_pid_cmp);
+	return nr;
+}
 
-		/* Basic links */
-		data.check = true;
-		snprintf(tmp, sizeof(tmp), "/proc/%s/root", de);
-		if (ofl_one(mnt, tmp, &data))
-			continue;
-		snprintf(tmp, sizeof(tmp), "/proc/%s/cwd", de);
-		if (ofl_one(mnt, tmp, &data))
-			continue;
-		snprintf(tmp, sizeof(tmp), "/proc/%s/exe", de);
-		if (ofl_one(mnt, tmp, &data))
-			continue;
+/**
+ * ofl_merge - print the workers' output in PID order
+ *
+ * Each worker's records are ascending already (slices are handed out in
+ * order), so this is a plain merge.
+ */
+static void ofl_merge(struct ofl_worker *w, unsigned int nr)
+{
+	size_t *pos = calloc(nr, sizeof(*pos));
+	const struct ofl_rec *r;
+	unsigned int i, best;
 
-		/* All file descriptors */
-		data.check = false;
-		snprintf(tmp, sizeof(tmp), "/proc/%s/task", de);
-		ofl_task(mnt, tmp, &data);
+	if (pos == NULL)
+		return;
+	while (true) {
+		best = nr;
+		for (i = 0; i < nr; ++i)
+			if (pos[i] < w[i].data.out.nr_rec && (best == nr ||
+			    w[i].data.out.rec[pos[i]].pid <
+			    w[best].data.out.rec[pos[best]].pid))
+				best = i;
+		if (best == nr)
+			break;
+		r = &w[best].data.out.rec[pos[best]++];
+		fwrite(w[best].data.out.buf + r->off, r->len, 1, stdout);
 	}
+	free(pos);
+}
+
+/**
+ * ofl - filesystem use checker
+ * @mnt:	mountpoint to search for
+ * @action:	action to take
+ *
+ * Everything below /proc is looked up relative to directory descriptors,
+ * so the kernel does not have to walk the full path on every access.
+ * The processes are spread over a number of threads; each collects its
+ * output separately, and the result is printed sorted by PID.
+ */
+static bool ofl(const char *mnt, unsigned int signum)
+{
+	struct ofl_scan scan = {};
+	struct ofl_worker *w;
+	unsigned int nr, i;
+	size_t mnt_len;
+	bool found = false;
+	long cpus;
+
+	/* Strip extra slashes at the end */
+	mnt_len = strlen(mnt);
+	while (mnt_len > 0 && mnt[mnt_len-1] == '/')
+		--mnt_len;
 
-	return data.found;
+	scan.nr_pids = ofl_pids(&scan.pids);
+	if (scan.nr_pids == 0)
+		return false;
+	nr = ofl_jobs;
+	if (nr == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nr   = cpus < 1 ? 1 : cpus;
+	}
+	if (nr > (scan.nr_pids + ofl_slice - 1) / ofl_slice)
+		nr = (scan.nr_pids + ofl_slice - 1) / ofl_slice;
+	w = calloc(nr, sizeof(*w));
+	if (w == NULL) {
+		free(scan.pids);
+		return false;
+	}
+	for (i = 0; i < nr; ++i) {
+		w[i].scan         = &scan;
+		w[i].data.mnt     = mnt;
+		w[i].data.mnt_len = mnt_len;
+		w[i].data.signal  = signum;
+	}
+	/* This thread is worker 0 */
+	for (i = 1; i < nr; ++i)
+		if (pthread_create(&w[i].tid, NULL, ofl_worker_main,
+		    &w[i]) != 0)
+			break;
+	nr = i;
+	ofl_worker_main(&w[0]);
+	for (i = 1; i < nr; ++i)
+		pthread_join(w[i].tid, NULL);
+
+	ofl_merge(w, nr);
+	for (i = 0; i < nr; ++i) {
+		found |= w[i].data.found;
+		free(w[i].data.out.buf);
+		free(w[i].data.out.rec);
+	}
+	free(w);
+	free(scan.pids);
+	return found;
 }
 
 static unsigned int parse_signal(const char *str)
@@ -296,6 +573,9 @@ int main(int argc, const char **argv)
 	struct HXoption options_table[] = {
 		{.sh = 'P', .type = HXTYPE_NONE, .ptr = &pids_only,
 		 .help = "Show only PIDs"},
+		{.sh = 'j', .type = HXTYPE_UINT, .ptr = &ofl_jobs,
+		 .help = "Number of scanning threads (default: online CPUs)",
+		 .htyp = "N"},
 		{.sh = 'k', .type = HXTYPE_STRING, .ptr = &signum_str,
 		 .help = "Signal to send (if any)", .htyp = "NUM/NAME"},
 		HXOPT_AUTOHELP,
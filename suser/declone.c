@@ -6,63 +6,807 @@
  *	modify it under the terms of the WTF Public License version 2 or
  *	(at your option) any later version.
  */
+#define _GNU_SOURCE 1
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#define BLOCKSIZE 4096
+#include <libHX/defs.h>
+#include <libHX/init.h>
+#include <libHX/option.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include "config.h"
 
-int main(int argc, const char **argv)
+enum {
+	DECLONE_UNSHARE,
+	DECLONE_REFLINK,
+};
+
+static unsigned int declone_mode = DECLONE_UNSHARE;
+static unsigned int declone_recursive, declone_jobs, declone_extents;
+static unsigned int declone_verbose;
+/* One copy buffer per thread, allocated on first use */
+static __thread unsigned char *declone_buf;
+static const size_t declone_bufsize = 1 << 20;
+
+static bool declone_get_options(int *argc, const char ***argv)
 {
-	++argv;
-	for (; --argc > 0 && *argv != NULL; ++argv) {
-		struct stat sb;
-		ssize_t ret;
-		char buffer[BLOCKSIZE];
-		int in, out;
+	static const struct HXoption options_table[] = {
+		{.sh = 'r', .ln = "reflink", .ptr = &declone_mode,
+		 .type = HXTYPE_VAL, .val = DECLONE_REFLINK,
+		 .help = "Only break the hardlink; keep sharing extents"},
+		{.sh = 'u', .ln = "unshare", .ptr = &declone_mode,
+		 .type = HXTYPE_VAL, .val = DECLONE_UNSHARE,
+		 .help = "Make a real copy of the data (default)"},
+		{.sh = 'R', .ln = "recursive", .ptr = &declone_recursive,
+		 .type = HXTYPE_NONE,
+		 .help = "Declone all hardlinked files below directories"},
+		{.sh = 'j', .ln = "jobs", .ptr = &declone_jobs,
+		 .type = HXTYPE_UINT,
+		 .help = "Number of threads for -R (default: online CPUs)",
+		 .htyp = "N"},
+		{.ln = "extents", .ptr = &declone_extents, .type = HXTYPE_NONE,
+		 .help = "With -R -u, also pick files with shared extents"},
+		{.sh = 'v', .ln = "verbose", .ptr = &declone_verbose,
+		 .type = HXTYPE_NONE,
+		 .help = "With -R, list every file that is decloned"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
 
-		if ((in = open(*argv, O_RDONLY)) < 0) {
-			fprintf(stderr, "Could not open %s: %s\n",
-			        *argv, strerror(errno));
+	return HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) ==
+	       HXOPT_ERR_SUCCESS;
+}
+
+/**
+ * declone_unsupported - whether an error means "try the next method"
+ */
+static bool declone_unsupported(int err)
+{
+	return err == -ENOSYS || err == -EOPNOTSUPP || err == -EXDEV ||
+	       err == -EINVAL || err == -ENOTTY || err == -EBADF;
+}
+
+static int declone_reflink(int in, int out)
+{
+#ifdef FICLONE
+	return ioctl(out, FICLONE, in) < 0 ? -errno : 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/**
+ * declone_copy_range - copy with copy_file_range(2)
+ *
+ * The data does not pass through userspace. Note that on filesystems
+ * with reflink support, the kernel is free to share extents instead.
+ */
+static int declone_copy_range(int in, int out, off_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t ioff = 0, ooff = 0;
+	ssize_t ret;
+
+	while (ioff < size) {
+		ret = copy_file_range(in, &ioff, out, &ooff, size - ioff, 0);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			/* Pseudo-files report 0; so does a shrinking file */
+			return ioff == 0 ? -EOPNOTSUPP : 0;
+	}
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/**
+ * declone_rw - copy through a userspace buffer
+ *
+ * Works for everything, and is what "unshare" falls back to when
+ * copy_file_range would merely have shared the extents again.
+ */
+static int declone_rw(int in, int out)
+{
+	off_t off = 0;
+	ssize_t ret, wr;
+	size_t done;
+
+	if (declone_buf == NULL) {
+		declone_buf = malloc(declone_bufsize);
+		if (declone_buf == NULL)
+			return -errno;
+	}
+	while ((ret = pread(in, declone_buf, declone_bufsize, off)) != 0) {
+		if (ret < 0 && errno == EINTR)
 			continue;
+		if (ret < 0)
+			return -errno;
+		for (done = 0; done < (size_t)ret; done += wr) {
+			wr = pwrite(out, declone_buf + done, ret - done,
+			     off + done);
+			if (wr < 0 && errno == EINTR)
+				wr = 0;
+			else if (wr < 0)
+				return -errno;
 		}
-		if (fstat(in, &sb) < 0) {
-			fprintf(stderr, "Could not stat %s: %s\n",
-			        *argv, strerror(errno));
-			continue;
+		off += ret;
+	}
+	return 0;
+}
+
+/**
+ * declone_shared - whether any extent of @fd is shared with another file
+ */
+static bool declone_shared(int fd)
+{
+	union {
+		struct fiemap fm;
+		char raw[sizeof(struct fiemap) +
+		         64 * sizeof(struct fiemap_extent)];
+	} u;
+	const struct fiemap_extent *ext;
+	unsigned int i;
+	__u64 start = 0;
+
+	while (true) {
+		memset(&u.fm, 0, sizeof(u.fm));
+		u.fm.fm_start        = start;
+		u.fm.fm_length       = FIEMAP_MAX_OFFSET - start;
+		u.fm.fm_extent_count = 64;
+		if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) < 0 ||
+		    u.fm.fm_mapped_extents == 0)
+			return false;
+		for (i = 0; i < u.fm.fm_mapped_extents; ++i) {
+			ext = &u.fm.fm_extents[i];
+			if (ext->fe_flags & FIEMAP_EXTENT_SHARED)
+				return true;
+			if (ext->fe_flags & FIEMAP_EXTENT_LAST)
+				return false;
 		}
-		if (unlink(*argv) < 0) {
-			fprintf(stderr, "Could not unlink %s: %s\n",
-			        *argv, strerror(errno));
+		start = ext->fe_logical + ext->fe_length;
+	}
+}
+
+/**
+ * declone_data - fill @out with the contents of @in
+ *
+ * Reflink mode tries FICLONE first, which only copies metadata. Unshare
+ * mode must end up with extents of its own; copy_file_range is tried
+ * first because it avoids userspace crossings, but if the kernel chose
+ * to share extents, the data is copied once more through a buffer.
+ */
+static int declone_data(int in, int out, const struct stat *sb)
+{
+	int ret;
+
+	if (declone_mode == DECLONE_REFLINK) {
+		ret = declone_reflink(in, out);
+		if (!declone_unsupported(ret))
+			return ret;
+	}
+	ret = declone_copy_range(in, out, sb->st_size);
+	if (ret == 0 && (declone_mode == DECLONE_REFLINK ||
+	    !declone_shared(out)))
+		return 0;
+	if (ret != 0 && !declone_unsupported(ret))
+		return ret;
+	if (ftruncate(out, 0) < 0)
+		return -errno;
+	return declone_rw(in, out);
+}
+
+/**
+ * declone_tmpfile - create the file that is to replace @base
+ * @tmpname:	receives a free name in @dfd (not yet linked for O_TMPFILE)
+ * @anon:	set if the file is an O_TMPFILE and still needs linkat
+ *
+ * O_TMPFILE keeps a half-written copy invisible, and it vanishes by
+ * itself on a crash. Filesystems without it get an ordinary temporary
+ * file next to the original.
+ */
+static int declone_tmpfile(int dfd, char *tmpname, size_t size, bool *anon)
+{
+	static unsigned int seq;
+	int fd;
+
+	fd = openat(dfd, ".", O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	*anon = fd >= 0;
+	while (true) {
+		snprintf(tmpname, size, ".declone.%u.%u",
+		         static_cast(unsigned int, getpid()),
+		         __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED));
+		if (*anon)
+			return fd;
+		fd = openat(dfd, tmpname, O_RDWR | O_CREAT | O_EXCL,
+		     S_IRUSR | S_IWUSR);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+}
+
+/**
+ * declone_xattrs - copy all extended attributes (and with them, ACLs)
+ */
+static int declone_xattrs(int in, int out)
+{
+	char *list = NULL, *name, *value = NULL;
+	ssize_t lsize, vsize;
+	int ret = 0;
+
+	lsize = flistxattr(in, NULL, 0);
+	if (lsize <= 0)
+		return lsize < 0 && errno != ENOTSUP ? -errno : 0;
+	list = malloc(lsize);
+	if (list == NULL)
+		return -errno;
+	lsize = flistxattr(in, list, lsize);
+	if (lsize < 0) {
+		ret = -errno;
+		goto out;
+	}
+	for (name = list; name < list + lsize; name += strlen(name) + 1) {
+		vsize = fgetxattr(in, name, NULL, 0);
+		if (vsize < 0)
 			continue;
+		free(value);
+		value = malloc(vsize + 1);
+		if (value == NULL) {
+			ret = -errno;
+			break;
 		}
-		if ((out = open(*argv, O_WRONLY | O_TRUNC | O_CREAT,
-		    sb.st_mode)) < 0) {
-			fprintf(stderr, "Could not recreate/open file %s: %s\n",
-			        *argv, strerror(errno));
-			fgets(buffer, 4, stdin);
+		vsize = fgetxattr(in, name, value, vsize);
+		if (vsize < 0)
 			continue;
+		/* security.* may need privileges that we do not have */
+		if (fsetxattr(out, name, value, vsize, 0) < 0 &&
+		    errno != EPERM && errno != ENOTSUP) {
+			ret = -errno;
+			break;
+		}
+	}
+ out:
+	free(value);
+	free(list);
+	return ret;
+}
+
+/**
+ * declone_meta - give @out the owner, mode, xattrs and times of @in
+ *
+ * chown must come before chmod, which would otherwise lose the set-id
+ * bits. Not being able to chown is not an error for ordinary users.
+ */
+static int declone_meta(int in, int out, const struct stat *sb)
+{
+	const struct timespec ts[2] = {sb->st_atim, sb->st_mtim};
+	int ret;
+
+	if (fchown(out, sb->st_uid, sb->st_gid) < 0 && errno != EPERM)
+		return -errno;
+	if (fchmod(out, sb->st_mode & 07777) < 0)
+		return -errno;
+	ret = declone_xattrs(in, out);
+	if (ret < 0)
+		return ret;
+	if (futimens(out, ts) < 0)
+		return -errno;
+	return 0;
+}
+
+/**
+ * declone_link - give the O_TMPFILE @fd the name @tmpname in @dfd
+ */
+static int declone_link(int fd, int dfd, const char *tmpname)
+{
+	char proc[sizeof("/proc/self/fd/") + 12];
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, proc, dfd, tmpname, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+	/* Without /proc; needs CAP_DAC_READ_SEARCH */
+	if (linkat(fd, "", dfd, tmpname, AT_EMPTY_PATH) == 0)
+		return 0;
+	return -errno;
+}
+
+/**
+ * declone_commit - atomically put @tmpname in place of @base
+ *
+ * With RENAME_EXCHANGE, the original ends up under @tmpname, where it
+ * can be checked to still be the inode that was copied. If the name was
+ * replaced by someone else in the meantime, the swap is undone and the
+ * copy discarded. Otherwise, plain rename(2) semantics apply.
+ */
+static int declone_commit(int dfd, const char *tmpname, const char *base,
+    const struct stat *sb)
+{
+#ifdef HAVE_RENAMEAT2
+	struct stat old;
+
+	if (renameat2(dfd, tmpname, dfd, base, RENAME_EXCHANGE) == 0) {
+		if (fstatat(dfd, tmpname, &old, AT_SYMLINK_NOFOLLOW) == 0 &&
+		    (old.st_dev != sb->st_dev || old.st_ino != sb->st_ino)) {
+			renameat2(dfd, tmpname, dfd, base, RENAME_EXCHANGE);
+			unlinkat(dfd, tmpname, 0);
+			return -ESTALE;
 		}
+		unlinkat(dfd, tmpname, 0);
+		return 0;
+	}
+	if (errno != EINVAL && errno != ENOSYS)
+		return -errno;
+#endif
+	if (renameat(dfd, tmpname, dfd, base) < 0)
+		return -errno;
+	return 0;
+}
 
-		printf("* %s\n", *argv);
-		fchown(out, sb.st_uid, sb.st_gid);
-		fchmod(out, sb.st_mode);
-		while ((ret = read(in, buffer, BLOCKSIZE)) > 0)
-			if (write(out, buffer, ret) < 0) {
-				fprintf(stderr, "Error during write() to %s: "
-				        "%s\n", *argv, strerror(errno));
-				break;
-			}
+/**
+ * declone_file - replace @file by a copy of itself
+ * @batch:	called from the -R pool
+ *
+ * The copy is built invisibly in the same directory, synced, and then
+ * renamed over the original in one step. At no time is the name missing
+ * or pointing to a partial file, so this is safe on files in use.
+ *
+ * In batch mode, a file is skipped (returning 1) if it has become the
+ * last link to its inode, e.g. because its siblings in the tree were
+ * decloned already, unless --extents finds it sharing data.
+ */
+static int declone_file(const char *file, bool batch)
+{
+	const char *base = strrchr(file, '/');
+	char *dir, tmpname[NAME_MAX + 1];
+	struct stat sb, sb2;
+	int in, out, dfd, ret;
+	bool anon;
 
+	if ((in = open(file, O_RDONLY)) < 0) {
+		fprintf(stderr, "Could not open %s: %s\n",
+		        file, strerror(errno));
+		return -errno;
+	}
+	if (fstat(in, &sb) < 0) {
+		ret = -errno;
+		fprintf(stderr, "Could not stat %s: %s\n",
+		        file, strerror(-ret));
+		close(in);
+		return ret;
+	}
+	if (!S_ISREG(sb.st_mode)) {
+		fprintf(stderr, "%s: not a regular file\n", file);
+		close(in);
+		return -EINVAL;
+	}
+	if (batch && sb.st_nlink == 1 && !(declone_extents &&
+	    declone_mode == DECLONE_UNSHARE && declone_shared(in))) {
+		close(in);
+		return 1;
+	}
+	if (base == NULL) {
+		dir  = strdup(".");
+		base = file;
+	} else {
+		dir = strndup(file, base == file ? 1 : base - file);
+		++base;
+	}
+	dfd = dir != NULL ? open(dir, O_RDONLY | O_DIRECTORY) : -1;
+	if (dfd < 0) {
+		ret = -errno;
+		fprintf(stderr, "Could not open directory of %s: %s\n",
+		        file, strerror(-ret));
+		free(dir);
+		close(in);
+		return ret;
+	}
+	free(dir);
+	out = declone_tmpfile(dfd, tmpname, sizeof(tmpname), &anon);
+	if (out < 0) {
+		ret = -errno;
+		fprintf(stderr, "Could not create a file next to %s: %s\n",
+		        file, strerror(-ret));
+		close(dfd);
+		close(in);
+		return ret;
+	}
+
+	if (!batch || declone_verbose)
+		printf("* %s\n", file);
+	ret = declone_data(in, out, &sb);
+	if (ret == 0)
+		ret = declone_meta(in, out, &sb);
+	if (ret == 0 && fsync(out) < 0)
+		ret = -errno;
+	if (ret == 0 && fstat(in, &sb2) == 0 && (sb2.st_size != sb.st_size ||
+	    sb2.st_mtim.tv_sec != sb.st_mtim.tv_sec ||
+	    sb2.st_mtim.tv_nsec != sb.st_mtim.tv_nsec))
+		ret = -EAGAIN;
+	if (ret == 0 && anon)
+		ret = declone_link(out, dfd, tmpname);
+	else if (ret != 0 && !anon)
+		unlinkat(dfd, tmpname, 0);
+	if (ret == 0) {
+		ret = declone_commit(dfd, tmpname, base, &sb);
 		if (ret < 0)
-			fprintf(stderr, "Error during read() on %s: %s\n",
+			unlinkat(dfd, tmpname, 0);
+	}
+	if (ret == 0)
+		fsync(dfd);
+	else if (ret == -EAGAIN || ret == -ESTALE)
+		fprintf(stderr, "%s changed while being copied, left alone\n",
+		        file);
+	else
+		fprintf(stderr, "Error while decloning %s: %s\n",
+		        file, strerror(-ret));
+	close(out);
+	close(dfd);
+	close(in);
+	return ret;
+}
+
+struct declone_ino {
+	dev_t dev;
+	ino_t ino;
+};
+
+/**
+ * @q:		ring of paths waiting for a worker
+ * @more:	signalled when @q gains an entry or @done is set
+ * @space:	signalled when @q loses an entry
+ * @tick:	wakes the progress reporter early once all is done
+ * @released:	signalled when an entry leaves @busy
+ * @busy:	inodes currently being decloned, at most one per worker
+ * @found:	files queued by the walker
+ * @files, @skipped, @failed:	outcomes so far
+ * @bytes:	data copied so far
+ * @tty:	stderr is a terminal, so the report can be redrawn in place
+ */
+struct declone_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t more, space, tick, released;
+	char **q;
+	unsigned int head, len, cap;
+	struct declone_ino *busy;
+	unsigned int nr_busy;
+	bool done, finished, tty;
+	unsigned long long found, files, skipped, failed, bytes;
+	struct timespec start;
+};
+
+static double declone_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec - start->tv_sec +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/**
+ * declone_report - print the counters (caller holds the lock)
+ */
+static void declone_report(const struct declone_pool *pool, const char *end)
+{
+	double t = declone_elapsed(&pool->start);
+
+	fprintf(stderr, "%s%llu/%llu files decloned, %llu skipped, "
+	        "%llu failed, %.1f MB (%.1f MB/s, %.0f files/s)%s",
+	        pool->tty ? "\r" : "", pool->files, pool->found,
+	        pool->skipped, pool->failed,
+	        pool->bytes / 1048576.0,
+	        t > 0 ? pool->bytes / 1048576.0 / t : 0,
+	        t > 0 ? pool->files / t : 0, end);
+}
+
+static void *declone_progress(void *arg)
+{
+	struct declone_pool *pool = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->finished) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		++ts.tv_sec;
+		pthread_cond_timedwait(&pool->tick, &pool->lock, &ts);
+		if (!pool->finished)
+			declone_report(pool, "");
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/**
+ * declone_claim - mark the inode behind @path as being worked on
+ *
+ * Links of the same inode are decloned one after the other, so that the
+ * link count checked by declone_file is not stale: once a sibling has been
+ * replaced, the last remaining link is seen as such and skipped. Returns
+ * false if @path needs no claim (single link, or not stat-able; the latter
+ * is reported by declone_file).
+ */
+static bool declone_claim(struct declone_pool *pool, const char *path,
+    struct declone_ino *id)
+{
+	struct stat sb;
+	unsigned int i;
+
+	if (stat(path, &sb) < 0 || sb.st_nlink < 2)
+		return false;
+	id->dev = sb.st_dev;
+	id->ino = sb.st_ino;
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nr_busy; ) {
+		if (pool->busy[i].dev == id->dev &&
+		    pool->busy[i].ino == id->ino) {
+			pthread_cond_wait(&pool->released, &pool->lock);
+			i = 0;
+			continue;
+		}
+		++i;
+	}
+	pool->busy[pool->nr_busy++] = *id;
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+/* Caller holds the lock */
+static void declone_release(struct declone_pool *pool,
+    const struct declone_ino *id)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->nr_busy; ++i) {
+		if (pool->busy[i].dev != id->dev ||
+		    pool->busy[i].ino != id->ino)
+			continue;
+		pool->busy[i] = pool->busy[--pool->nr_busy];
+		pthread_cond_broadcast(&pool->released);
+		break;
+	}
+}
+
+static void *declone_worker(void *arg)
+{
+	struct declone_pool *pool = arg;
+	struct declone_ino id;
+	struct stat sb;
+	bool claimed;
+	char *path;
+	int ret;
+
+	while (true) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->len == 0 && !pool->done)
+			pthread_cond_wait(&pool->more, &pool->lock);
+		if (pool->len == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		path = pool->q[pool->head];
+		pool->head = (pool->head + 1) % pool->cap;
+		--pool->len;
+		pthread_cond_signal(&pool->space);
+		pthread_mutex_unlock(&pool->lock);
+
+		claimed = declone_claim(pool, path, &id);
+		ret = declone_file(path, true);
+		if (ret == 0 && stat(path, &sb) < 0)
+			sb.st_size = 0;
+		pthread_mutex_lock(&pool->lock);
+		if (claimed)
+			declone_release(pool, &id);
+		if (ret < 0) {
+			++pool->failed;
+		} else if (ret > 0) {
+			++pool->skipped;
+		} else {
+			++pool->files;
+			pool->bytes += sb.st_size;
+		}
+		pthread_mutex_unlock(&pool->lock);
+		free(path);
+	}
+	free(declone_buf);
+	return NULL;
+}
+
+/**
+ * declone_queue - hand @path to the workers, taking ownership
+ *
+ * Blocks while the queue is full, so that a huge tree is not held in
+ * memory all at once.
+ */
+static void declone_queue(struct declone_pool *pool, char *path)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->len == pool->cap)
+		pthread_cond_wait(&pool->space, &pool->lock);
+	pool->q[(pool->head + pool->len++) % pool->cap] = path;
+	++pool->found;
+	pthread_cond_signal(&pool->more);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * declone_walk - queue the regular files below @path that need decloning
+ *
+ * Those are the ones with more than one link; with --extents, every
+ * regular file is queued and the worker checks for shared extents.
+ */
+static int declone_walk(struct declone_pool *pool, const char *path)
+{
+	struct dirent *de;
+	struct stat sb;
+	int ret = 0;
+	char *sub;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		ret = -errno;
+		fprintf(stderr, "Could not open directory %s: %s\n",
+		        path, strerror(-ret));
+		return ret;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		if (de->d_type != DT_UNKNOWN && de->d_type != DT_DIR &&
+		    de->d_type != DT_REG)
+			continue;
+		if (fstatat(dirfd(dir), de->d_name, &sb,
+		    AT_SYMLINK_NOFOLLOW) < 0) {
+			ret = -errno;
+			fprintf(stderr, "Could not stat %s/%s: %s\n",
+			        path, de->d_name, strerror(-ret));
+			continue;
+		}
+		if (!S_ISDIR(sb.st_mode) && (!S_ISREG(sb.st_mode) ||
+		    (sb.st_nlink == 1 && !declone_extents)))
+			continue;
+		if (asprintf(&sub, "%s/%s", path, de->d_name) < 0) {
+			ret = -ENOMEM;
+			break;
+		}
+		if (S_ISREG(sb.st_mode)) {
+			declone_queue(pool, sub);
+			continue;
+		}
+		if (declone_walk(pool, sub) < 0)
+			ret = -1;
+		free(sub);
+	}
+	closedir(dir);
+	return ret;
+}
+
+/**
+ * declone_tree - declone everything below the given directories
+ *
+ * One thread walks, a fixed number of workers declone. Files given
+ * directly are queued as well.
+ */
+static int declone_tree(const char **argv)
+{
+	struct declone_pool pool = {
+		.lock  = PTHREAD_MUTEX_INITIALIZER,
+		.more  = PTHREAD_COND_INITIALIZER,
+		.space = PTHREAD_COND_INITIALIZER,
+		.tick  = PTHREAD_COND_INITIALIZER,
+		.released = PTHREAD_COND_INITIALIZER,
+		.tty   = isatty(STDERR_FILENO),
+	};
+	bool progress = pool.tty;
+	int ret = EXIT_SUCCESS;
+	unsigned int nr, i;
+	pthread_t *tid, ptid;
+	struct stat sb;
+	char *path;
+	long cpus;
+
+	if (declone_jobs == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		declone_jobs = cpus < 1 ? 1 : cpus;
+	}
+	pool.cap = 64 * declone_jobs;
+	pool.q   = malloc(pool.cap * sizeof(*pool.q));
+	tid      = malloc(declone_jobs * sizeof(*tid));
+	pool.busy = malloc(declone_jobs * sizeof(*pool.busy));
+	if (pool.q == NULL || tid == NULL || pool.busy == NULL) {
+		perror("malloc");
+		free(pool.busy);
+		free(pool.q);
+		free(tid);
+		return EXIT_FAILURE;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &pool.start);
+	for (nr = 0; nr < declone_jobs; ++nr)
+		if (pthread_create(&tid[nr], NULL, declone_worker, &pool) != 0)
+			break;
+	if (nr == 0) {
+		fprintf(stderr, "Could not start any threads\n");
+		free(pool.busy);
+		free(pool.q);
+		free(tid);
+		return EXIT_FAILURE;
+	}
+	if (progress &&
+	    pthread_create(&ptid, NULL, declone_progress, &pool) != 0)
+		progress = false;
+
+	for (; *argv != NULL; ++argv) {
+		if (lstat(*argv, &sb) < 0) {
+			fprintf(stderr, "Could not stat %s: %s\n",
 			        *argv, strerror(errno));
-		close(in);
-		close(out);
+			ret = EXIT_FAILURE;
+		} else if (S_ISDIR(sb.st_mode)) {
+			if (declone_walk(&pool, *argv) < 0)
+				ret = EXIT_FAILURE;
+		} else if ((path = strdup(*argv)) != NULL) {
+			declone_queue(&pool, path);
+		}
+	}
+
+	pthread_mutex_lock(&pool.lock);
+	pool.done = true;
+	pthread_cond_broadcast(&pool.more);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < nr; ++i)
+		pthread_join(tid[i], NULL);
+	pthread_mutex_lock(&pool.lock);
+	pool.finished = true;
+	pthread_cond_signal(&pool.tick);
+	pthread_mutex_unlock(&pool.lock);
+	if (progress)
+		pthread_join(ptid, NULL);
+	declone_report(&pool, "\n");
+	if (pool.failed > 0)
+		ret = EXIT_FAILURE;
+	free(pool.busy);
+	free(pool.q);
+	free(tid);
+	return ret;
+}
+
+static int main2(int argc, const char **argv)
+{
+	int ret = EXIT_SUCCESS;
+
+	if (!declone_get_options(&argc, &argv))
+		return EXIT_FAILURE;
+	if (declone_recursive)
+		return declone_tree(argv + 1);
+	while (*++argv != NULL)
+		if (declone_file(*argv, false) < 0)
+			ret = EXIT_FAILURE;
+	return ret;
+}
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	if ((ret = HX_init()) <= 0) {
+		fprintf(stderr, "HX_init: %s\n", strerror(-ret));
+		abort();
 	}
-	return EXIT_SUCCESS;
+	ret = main2(argc, argv);
+	HX_exit();
+	return ret;
 }
@@ -8,23 +8,52 @@
  *	of the License, or (at your option) any later version.
  *	For details, see the file named "LICENSE.GPL2".
  */
+#define _GNU_SOURCE 1
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sched.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libHX/ctype_helper.h>
+#include <libHX/defs.h>
 #include <libHX/init.h>
 #include <libHX/option.h>
+#include <linux/fs.h>
+#if defined(__x86_64__)
+#	include <immintrin.h>
+#endif
+
+/**
+ * @start:	first byte; negative values count from the end of the file
+ * @end:	one past the last byte, or LLONG_MAX for EOF
+ * @rel:	@end is a length relative to @start
+ */
+struct range {
+	long long start, end;
+	bool rel;
+};
 
 static struct {
 	long long start;
-	int approx, follow, bsize, quad;
+	int approx, follow, bsize, quad, bad_arg, context, color, json;
+	int cached;
+	char *layout;
+	struct range *ranges;
+	unsigned int nr_ranges;
+	unsigned char *pattern;
+	size_t pattern_len;
 } Opt = {
 	.start  = 0,
 	.approx = 0,
@@ -38,6 +67,371 @@ static void getopt_op_e(const struct HXoptcb *cbi)
 	Opt.start = strtoll(cbi->data, NULL, 0);
 }
 
+static void getopt_find_str(const struct HXoptcb *cbi)
+{
+	free(Opt.pattern);
+	Opt.pattern     = NULL;
+	Opt.pattern_len = 0;
+	if (*cbi->data == '\0') {
+		fprintf(stderr, "Empty search pattern\n");
+		Opt.bad_arg = 1;
+		return;
+	}
+	Opt.pattern     = (unsigned char *)strdup(cbi->data);
+	Opt.pattern_len = Opt.pattern != NULL ? strlen(cbi->data) : 0;
+}
+
+/**
+ * getopt_find - parse --find HEXBYTES
+ *
+ * Whitespace and colons between the digits are ignored, so that both
+ * "deadbeef" and "de:ad:be:ef" work.
+ */
+static void getopt_find(const struct HXoptcb *cbi)
+{
+	const char *p;
+	unsigned int n = 0;
+	unsigned char *pat;
+
+	free(Opt.pattern);
+	Opt.pattern     = NULL;
+	Opt.pattern_len = 0;
+	pat = calloc(strlen(cbi->data) / 2 + 1, 1);
+	if (pat == NULL) {
+		perror("calloc");
+		return;
+	}
+	for (p = cbi->data; *p != '\0'; ++p) {
+		if (HX_isspace(*p) || *p == ':')
+			continue;
+		if (!HX_isxdigit(*p))
+			break;
+		pat[n/2] = (pat[n/2] << 4) |
+		           (HX_isdigit(*p) ? *p - '0' : HX_tolower(*p) - 'a' + 10);
+		++n;
+	}
+	if (*p != '\0' || n == 0 || n % 2 != 0) {
+		fprintf(stderr, "Invalid hex pattern \"%s\"\n", cbi->data);
+		Opt.bad_arg = 1;
+		free(pat);
+		return;
+	}
+	Opt.pattern     = pat;
+	Opt.pattern_len = n / 2;
+}
+
+/**
+ * getopt_range - parse --range START[-END|+LENGTH]
+ */
+static void getopt_range(const struct HXoptcb *cbi)
+{
+	struct range r = {.end = LLONG_MAX}, *nr;
+	const char *p = cbi->data;
+	char *end;
+
+	r.start = strtoll(p, &end, 0);
+	if (end == p)
+		goto bad;
+	p = end;
+	if (*p == '-' || *p == '+') {
+		r.rel = *p++ == '+';
+		if (*p != '\0') {
+			r.end = strtoll(p, &end, 0);
+			if (end == p || r.end < 0)
+				goto bad;
+			p = end;
+		}
+	}
+	if (*p != '\0')
+		goto bad;
+	nr = realloc(Opt.ranges, (Opt.nr_ranges + 1) * sizeof(*nr));
+	if (nr == NULL) {
+		perror("realloc");
+		return;
+	}
+	Opt.ranges = nr;
+	Opt.ranges[Opt.nr_ranges++] = r;
+	return;
+ bad:
+	fprintf(stderr, "Invalid range \"%s\"\n", cbi->data);
+	Opt.bad_arg = 1;
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @name:	label in the output
+ * @offset:	position within the record
+ * @size:	bytes taken up in the record
+ * @be:		multi-byte value is big-endian
+ * @emit:	renders the value (%NULL for padding)
+ */
+struct field {
+	char *name;
+	unsigned int offset, size;
+	bool be;
+	char *(*emit)(char *, const struct field *, const unsigned char *);
+};
+
+/**
+ * @field:	decoder table, in record order
+ * @size:	record size
+ * @max_out:	upper bound for the output of one record (without tag)
+ */
+static struct {
+	struct field *field;
+	unsigned int nr_field, size;
+	size_t max_out;
+} Layout;
+
+static uint64_t field_load(const struct field *f, const unsigned char *p)
+{
+	uint64_t v = 0;
+	unsigned int i;
+
+	if (f->be)
+		for (i = 0; i < f->size; ++i)
+			v = (v << 8) | p[i];
+	else
+		for (i = f->size; i-- > 0; )
+			v = (v << 8) | p[i];
+	return v;
+}
+
+static char *emit_u64(char *out, uint64_t v)
+{
+	char tmp[20], *p = tmp + sizeof(tmp);
+
+	do {
+		*--p = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	memcpy(out, p, tmp + sizeof(tmp) - p);
+	return out + (tmp + sizeof(tmp) - p);
+}
+
+static char *emit_uint(char *out, const struct field *f,
+    const unsigned char *p)
+{
+	return emit_u64(out, field_load(f, p));
+}
+
+static char *emit_sint(char *out, const struct field *f,
+    const unsigned char *p)
+{
+	uint64_t v = field_load(f, p);
+
+	if (f->size < 8 && (v & (1ULL << (8 * f->size - 1))))
+		v |= ~0ULL << (8 * f->size);
+	if ((int64_t)v >= 0)
+		return emit_u64(out, v);
+	*out++ = '-';
+	return emit_u64(out, -v);
+}
+
+static char *emit_float(char *out, const struct field *f,
+    const unsigned char *p)
+{
+	uint64_t v = field_load(f, p);
+	uint32_t v32 = v;
+	double d;
+	float fl;
+	int n;
+
+	if (f->size == 4) {
+		memcpy(&fl, &v32, sizeof(fl));
+		d = fl;
+	} else {
+		memcpy(&d, &v, sizeof(d));
+	}
+	/* JSON has no representation for these */
+	if (Opt.json && (d != d || d - d != 0)) {
+		memcpy(out, "null", 4);
+		return out + 4;
+	}
+	/* Shortest of the usual precisions that reads back identically */
+	if (f->size == 4) {
+		n = sprintf(out, "%.7g", d);
+		if (strtof(out, NULL) != fl)
+			n = sprintf(out, "%.9g", d);
+	} else {
+		n = sprintf(out, "%.15g", d);
+		if (strtod(out, NULL) != d)
+			n = sprintf(out, "%.17g", d);
+	}
+	return out + n;
+}
+
+/**
+ * emit_string - quote @len bytes of @p for text or JSON output
+ */
+static char *emit_string(char *out, const unsigned char *p, size_t len)
+{
+	size_t i;
+
+	*out++ = '"';
+	for (i = 0; i < len; ++i) {
+		if (p[i] == '"' || p[i] == '\\') {
+			*out++ = '\\';
+			*out++ = p[i];
+		} else if (p[i] >= 0x20 && p[i] < 0x7F) {
+			*out++ = p[i];
+		} else if (Opt.json) {
+			/* Bytes are taken as Latin-1 */
+			memcpy(out, "\\u00", 4);
+			out[4] = hex_digits[p[i] >> 4];
+			out[5] = hex_digits[p[i] & 0xF];
+			out += 6;
+		} else {
+			*out++ = '\\';
+			*out++ = 'x';
+			*out++ = hex_digits[p[i] >> 4];
+			*out++ = hex_digits[p[i] & 0xF];
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+static char *emit_char(char *out, const struct field *f,
+    const unsigned char *p)
+{
+	const unsigned char *nul = memchr(p, '\0', f->size);
+
+	return emit_string(out, p, nul != NULL ? (size_t)(nul - p) : f->size);
+}
+
+static char *emit_hex(char *out, const struct field *f,
+    const unsigned char *p)
+{
+	unsigned int i;
+
+	if (Opt.json)
+		*out++ = '"';
+	for (i = 0; i < f->size; ++i) {
+		*out++ = hex_digits[p[i] >> 4];
+		*out++ = hex_digits[p[i] & 0xF];
+	}
+	if (Opt.json)
+		*out++ = '"';
+	return out;
+}
+
+/**
+ * layout_field - parse one "type[:name]" element of a --layout spec
+ */
+static bool layout_field(struct field *f, char *spec)
+{
+	char *name = strchr(spec, ':'), *end;
+	unsigned long bits;
+	size_t out;
+
+	if (name != NULL)
+		*name++ = '\0';
+	memset(f, 0, sizeof(*f));
+	if (strncmp(spec, "char[", 5) == 0 || strncmp(spec, "hex[", 4) == 0 ||
+	    strncmp(spec, "pad[", 4) == 0) {
+		bits = strtoul(strchr(spec, '[') + 1, &end, 0);
+		if (bits == 0 || bits > 65536 || strcmp(end, "]") != 0)
+			return false;
+		f->size = bits;
+		if (*spec == 'c') {
+			f->emit = emit_char;
+			out = 6 * f->size + 2;
+		} else if (*spec == 'h') {
+			f->emit = emit_hex;
+			out = 2 * f->size + 2;
+		} else {
+			/* Padding is skipped and needs no name */
+			return true;
+		}
+	} else {
+		switch (*spec) {
+		case 'u': f->emit = emit_uint; break;
+		case 's': case 'i': f->emit = emit_sint; break;
+		case 'f': f->emit = emit_float; break;
+		default: return false;
+		}
+		bits = strtoul(spec + 1, &end, 10);
+		if (strcmp(end, "be") == 0)
+			f->be = true;
+		else if (strcmp(end, "le") == 0)
+			f->be = false;
+		else if (*end == '\0')
+			f->be = htonl(1) == 1;
+		else
+			return false;
+		if (f->emit == emit_float ? bits != 32 && bits != 64 :
+		    bits != 8 && bits != 16 && bits != 32 && bits != 64)
+			return false;
+		f->size = bits / 8;
+		out = 32;
+	}
+	/* Names go into the output verbatim, so keep them to identifiers */
+	if (name == NULL || *name == '\0' ||
+	    name[strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789_")] != '\0')
+		return false;
+	f->name = strdup(name);
+	if (f->name == NULL)
+		return false;
+	/* ,"name":value */
+	Layout.max_out += strlen(name) + 4 + out;
+	return true;
+}
+
+/**
+ * layout_compile - turn a --layout spec into the decoder table
+ *
+ * E.g. "u32le:pid,char[32]:line,pad[4],u64be:ts". Integers are u8..u64 or
+ * s8..s64 (also i8..i64), floats f32 and f64, each with an optional le/be
+ * suffix (default: host order). char[N] is a NUL-padded string, hex[N]
+ * raw bytes, pad[N] is skipped.
+ */
+static bool layout_compile(const char *spec)
+{
+	char *copy, *item, *colon, *save = NULL;
+	struct field f, *nf;
+
+	copy = strdup(spec);
+	if (copy == NULL)
+		return false;
+	Layout.max_out = sizeof("{\"offset\":18446744073709551615}\n") +
+	                 sizeof("0x0123456789abcdef |");
+	for (item = strtok_r(copy, ",", &save); item != NULL;
+	     item = strtok_r(NULL, ",", &save)) {
+		while (HX_isspace(*item))
+			++item;
+		colon = strchr(item, ':');
+		if (!layout_field(&f, item)) {
+			if (colon != NULL)
+				*colon = ':';
+			fprintf(stderr, "Invalid layout field \"%s\"\n", item);
+			free(copy);
+			return false;
+		}
+		f.offset     = Layout.size;
+		Layout.size += f.size;
+		if (f.emit == NULL)
+			continue;
+		nf = realloc(Layout.field, (Layout.nr_field + 1) * sizeof(*nf));
+		if (nf == NULL) {
+			free(copy);
+			return false;
+		}
+		Layout.field = nf;
+		Layout.field[Layout.nr_field++] = f;
+	}
+	free(copy);
+	if (Layout.size == 0) {
+		fprintf(stderr, "Empty layout\n");
+		return false;
+	}
+	/* A short record at EOF is shown as ,"truncated":"hex" */
+	Layout.max_out += 2 * Layout.size + 16;
+	return true;
+}
+
 static int get_options(int *argc, const char ***argv)
 {
 	static const struct HXoption options_table[] = {
@@ -51,18 +445,54 @@ static int get_options(int *argc, const char ***argv)
 		 .help = "Exact position start"},
 		{.sh = 'f', .type = HXTYPE_NONE, .ptr = &Opt.follow,
 		 .help = "Output appended data as file grows", NULL},
+		{.ln = "cached", .type = HXTYPE_NONE, .ptr = &Opt.cached,
+		 .help = "Read block devices through the page cache"},
+		{.ln = "range", .type = HXTYPE_STRING, .cb = getopt_range,
+		 .help = "Dump only this range (repeatable)",
+		 .htyp = "START[-END|+LEN]"},
+		{.ln = "find", .type = HXTYPE_STRING, .cb = getopt_find,
+		 .help = "Only show lines with this byte sequence",
+		 .htyp = "HEXBYTES"},
+		{.ln = "find-str", .type = HXTYPE_STRING, .cb = getopt_find_str,
+		 .help = "Only show lines with this string", .htyp = "TEXT"},
+		{.sh = 'C', .type = HXTYPE_INT, .ptr = &Opt.context,
+		 .help = "Lines of context around --find hits", .htyp = "N"},
+		{.ln = "color", .type = HXTYPE_NONE, .ptr = &Opt.color,
+		 .help = "Highlight hits even if output is not a terminal"},
+		{.ln = "layout", .type = HXTYPE_STRING, .ptr = &Opt.layout,
+		 .help = "Decode fixed-size records (e.g. u32le:pid,char[8]:tty)",
+		 .htyp = "SPEC"},
+		{.ln = "json", .type = HXTYPE_NONE, .ptr = &Opt.json,
+		 .help = "Print --layout records as JSON lines"},
 		HXOPT_AUTOHELP,
 		HXOPT_TABLEEND,
 	};
 
 	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
-	    HXOPT_ERR_SUCCESS)
+	    HXOPT_ERR_SUCCESS || Opt.bad_arg)
 		return 0;
 
 	if (*argc == 1) {
 		fprintf(stderr, "Error: You need to provide a filename\n");
 		return 0;
 	}
+	if (Opt.bsize <= 0) {
+		fprintf(stderr, "Error: Width must be positive\n");
+		return 0;
+	}
+	if (Opt.context < 0)
+		Opt.context = 0;
+	if (Opt.layout != NULL) {
+		if (!layout_compile(Opt.layout))
+			return 0;
+		/* One record per line */
+		Opt.bsize = Layout.size;
+	} else if (Opt.json) {
+		fprintf(stderr, "Error: --json needs --layout\n");
+		return 0;
+	}
+	if (isatty(STDOUT_FILENO))
+		Opt.color = 1;
 
 	return 1;
 }
@@ -72,79 +502,1225 @@ static inline char printable(char x)
 	return HX_isprint(x) ? x : '.';
 }
 
-static int main2(int argc, const char **argv)
+/*
+ * Output is rendered into this buffer a line at a time and leaves with a
+ * single write(2) once it is full, or before tailhex waits for more input.
+ */
+static struct {
+	char *buf;
+	size_t len, size;
+} Out;
+
+static char hex_pair[256][2], print_map[256];
+static bool fmt_ssse3;
+
+static void out_flush(void)
 {
-	unsigned int buf_offset = 0;
-	unsigned char *buf;
-	struct stat sb;
-	long long rax;
-	int ret, fd;
+	size_t done = 0;
+	ssize_t ret;
 
-	if (get_options(&argc, &argv) <= 0)
-		return EXIT_FAILURE;
+	while (done < Out.len) {
+		ret = write(STDOUT_FILENO, Out.buf + done, Out.len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		done += ret;
+	}
+	Out.len = 0;
+}
 
-	if ((buf = malloc(Opt.bsize)) == NULL) {
-		fprintf(stderr, "Could not allocate buffer of size %d\n", Opt.bsize);
-		return EXIT_FAILURE;
+/**
+ * line_size - upper bound for the length of one output line
+ */
+static size_t line_size(void)
+{
+	size_t pairs = (Opt.bsize + 1) / 2;
+
+	size_t n = sizeof("0x0123456789abcdef |") + 5 * pairs +
+	           sizeof(" | ") + 2 * pairs + 1;
+
+	return Layout.max_out > n ? Layout.max_out : n;
+}
+
+static const char hl_on[] = "\033[1;31m", hl_off[] = "\033[0m";
+
+/**
+ * hl_size - extra room a --color line may need for escape sequences
+ */
+static size_t hl_size(void)
+{
+	size_t width = (Opt.bsize + 1) & ~1U;
+
+	/* Worst case: every other byte highlighted, in both columns */
+	return Opt.color ? 2 * width * (sizeof(hl_on) + sizeof(hl_off)) : 0;
+}
+
+static int out_init(void)
+{
+	size_t line = line_size() + hl_size();
+
+	/* Room for at least one line including a file tag */
+	Out.size = line + PATH_MAX < 32768 ? 65536 : 2 * (line + PATH_MAX);
+	Out.buf  = malloc(Out.size);
+	return Out.buf != NULL;
+}
+
+static void fmt_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; ++i) {
+		hex_pair[i][0] = hex_digits[i >> 4];
+		hex_pair[i][1] = hex_digits[i & 0xF];
+		print_map[i]   = printable(i);
 	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	fmt_ssse3 = __builtin_cpu_supports("ssse3");
+	/* The vector path hardcodes the C locale's idea of printable */
+	for (i = 0; i < 256; ++i)
+		if ((print_map[i] != '.') != (i >= 0x20 && i < 0x7F) &&
+		    i != '.')
+			fmt_ssse3 = false;
+#endif
+}
 
-	if ((fd = open(*++argv, O_RDONLY)) < 0) {
-		fprintf(stderr, "Could not open %s: %s\n", *argv, strerror(errno));
-		return EXIT_FAILURE;
+/**
+ * fmt_pos - render the "0x%08llx |" (or %016llx) position column
+ */
+static char *fmt_pos(char *out, unsigned long long pos)
+{
+	unsigned int digits = 8;
+
+	if (Opt.quad || pos > 0xFFFFFFFFULL)
+		digits = 16;
+	*out++ = '0';
+	*out++ = 'x';
+	while (digits-- > 0)
+		*out++ = hex_digits[(pos >> (4 * digits)) & 0xF];
+	*out++ = ' ';
+	*out++ = '|';
+	return out;
+}
+
+#if defined(__x86_64__)
+/**
+ * fmt_body16 - render a full 16-byte line
+ *
+ * Nibbles are turned into digits with a PSHUFB table lookup; two more
+ * shuffles per 16 output bytes place them into the " xxxx" groups, and
+ * the gaps are filled in with spaces.
+ */
+__attribute__((target("ssse3")))
+static char *fmt_body16(char *out, const unsigned char *buf)
+{
+#define Z (-128)
+	const __m128i lut = _mm_loadu_si128((const __m128i *)hex_digits);
+	const __m128i nib = _mm_set1_epi8(0x0F);
+	const __m128i i0  = _mm_setr_epi8(Z, 0, 1, 2, 3, Z, 4, 5, 6, 7,
+	                                  Z, 8, 9, 10, 11, Z);
+	const __m128i s0  = _mm_setr_epi8(' ', 0, 0, 0, 0, ' ', 0, 0, 0, 0,
+	                                  ' ', 0, 0, 0, 0, ' ');
+	const __m128i i1a = _mm_setr_epi8(12, 13, 14, 15, Z, Z, Z, Z, Z, Z,
+	                                  Z, Z, Z, Z, Z, Z);
+	const __m128i i1b = _mm_setr_epi8(Z, Z, Z, Z, Z, 0, 1, 2, 3, Z,
+	                                  4, 5, 6, 7, Z, 8);
+	const __m128i s1  = _mm_setr_epi8(0, 0, 0, 0, ' ', 0, 0, 0, 0, ' ',
+	                                  0, 0, 0, 0, ' ', 0);
+	const __m128i i2  = _mm_setr_epi8(9, 10, 11, Z, 12, 13, 14, 15,
+	                                  Z, Z, Z, Z, Z, Z, Z, Z);
+	const __m128i s2  = _mm_setr_epi8(0, 0, 0, ' ', 0, 0, 0, 0,
+	                                  ' ', '|', ' ', 0, 0, 0, 0, 0);
+	__m128i v, hi, lo, a, b, ok;
+
+	v  = _mm_loadu_si128((const __m128i *)buf);
+	hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), nib));
+	lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, nib));
+	a  = _mm_unpacklo_epi8(hi, lo);
+	b  = _mm_unpackhi_epi8(hi, lo);
+	_mm_storeu_si128((__m128i *)out, _mm_or_si128(
+		_mm_shuffle_epi8(a, i0), s0));
+	_mm_storeu_si128((__m128i *)(out + 16), _mm_or_si128(_mm_or_si128(
+		_mm_shuffle_epi8(a, i1a), _mm_shuffle_epi8(b, i1b)), s1));
+	_mm_storeu_si128((__m128i *)(out + 32), _mm_or_si128(
+		_mm_shuffle_epi8(b, i2), s2));
+	out += 43;
+
+	/* 0x20..0x7E are printable (C locale); the rest becomes '.' */
+	ok = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+	     _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+	_mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_and_si128(ok, v),
+		_mm_andnot_si128(ok, _mm_set1_epi8('.'))));
+	return out + 16;
+#undef Z
+}
+#endif
+
+/**
+ * fmt_hl - switch highlighting on or off as needed before byte @i
+ */
+static char *fmt_hl(char *out, const unsigned char *hl, unsigned int i,
+    unsigned int len, bool *state)
+{
+	bool want = i < len && hl[i];
+
+	if (want == *state)
+		return out;
+	*state = want;
+	if (want) {
+		memcpy(out, hl_on, sizeof(hl_on) - 1);
+		return out + sizeof(hl_on) - 1;
 	}
+	memcpy(out, hl_off, sizeof(hl_off) - 1);
+	return out + sizeof(hl_off) - 1;
+}
+
+/**
+ * fmt_record - render a --layout record
+ *
+ * Text: [tag: ]0x00000000 | name=value name="string" ...
+ * JSON: {"file":"tag","offset":0,"name":value,...}
+ *
+ * A record cut short by EOF only makes it here in JSON mode, where it
+ * becomes {...,"offset":N,"truncated":"hexbytes"}.
+ */
+static void fmt_record(const char *tag, unsigned long long pos,
+    const unsigned char *buf, size_t len)
+{
+	size_t tlen = tag != NULL ? strlen(tag) : 0;
+	const struct field *f;
+	unsigned int i;
+	char *out;
+
+	if (Out.size - Out.len < Layout.max_out + 6 * tlen + 16)
+		out_flush();
+	out = Out.buf + Out.len;
+	if (Opt.json) {
+		*out++ = '{';
+		if (tag != NULL) {
+			memcpy(out, "\"file\":", 7);
+			out = emit_string(out + 7, (const void *)tag, tlen);
+			*out++ = ',';
+		}
+		memcpy(out, "\"offset\":", 9);
+		out = emit_u64(out + 9, pos);
+	} else {
+		if (tag != NULL) {
+			memcpy(out, tag, tlen);
+			out += tlen;
+			*out++ = ':';
+			*out++ = ' ';
+		}
+		out = fmt_pos(out, pos);
+	}
+	if (len < Layout.size) {
+		memcpy(out, ",\"truncated\":\"", 14);
+		out += 14;
+		for (i = 0; i < len; ++i) {
+			*out++ = hex_digits[buf[i] >> 4];
+			*out++ = hex_digits[buf[i] & 0xF];
+		}
+		memcpy(out, "\"}\n", 3);
+		Out.len = out + 3 - Out.buf;
+		return;
+	}
+	for (i = 0; i < Layout.nr_field; ++i) {
+		f = &Layout.field[i];
+		if (Opt.json) {
+			*out++ = ',';
+			*out++ = '"';
+			out = stpcpy(out, f->name);
+			*out++ = '"';
+			*out++ = ':';
+		} else {
+			*out++ = ' ';
+			out = stpcpy(out, f->name);
+			*out++ = '=';
+		}
+		out = f->emit(out, f, buf + f->offset);
+	}
+	if (Opt.json)
+		*out++ = '}';
+	*out++ = '\n';
+	Out.len = out - Out.buf;
+}
+
+/**
+ * fmt_line_hl - render one line of output into the output buffer
+ * @tag:	"tag: " prefix for the line, or %NULL
+ * @pos:	file position of @buf
+ * @len:	number of valid bytes in @buf (up to Opt.bsize)
+ * @hl:		per-byte flags for bytes to highlight, or %NULL
+ *
+ * The byte columns are padded to Opt.bsize rounded up to pairs, exactly
+ * as the printf-based formatter did.
+ */
+static void fmt_line_hl(const char *tag, unsigned long long pos,
+    const unsigned char *buf, unsigned int len, const unsigned char *hl)
+{
+	unsigned int i, width = (Opt.bsize + 1) & ~1U;
+	size_t tlen = tag != NULL ? strlen(tag) : 0;
+	size_t need = line_size() + tlen + 2;
+	bool state = false;
+	char *out;
+
+	if (Layout.size != 0 && (len == Layout.size || Opt.json)) {
+		fmt_record(tag, pos, buf, len);
+		return;
+	}
+	if (hl != NULL)
+		need += hl_size();
+	if (Out.size - Out.len < need)
+		out_flush();
+	out = Out.buf + Out.len;
+	if (tag != NULL) {
+		memcpy(out, tag, tlen);
+		out += tlen;
+		*out++ = ':';
+		*out++ = ' ';
+	}
+	out = fmt_pos(out, pos);
+#if defined(__x86_64__)
+	if (fmt_ssse3 && len == 16 && Opt.bsize == 16 && hl == NULL) {
+		out = fmt_body16(out, buf);
+		*out++ = '\n';
+		Out.len = out - Out.buf;
+		return;
+	}
+#endif
+	for (i = 0; i < width; ++i) {
+		if (i % 2 == 0) {
+			/* Highlighting does not cover the group separator */
+			if (state)
+				out = fmt_hl(out, hl, len, len, &state);
+			*out++ = ' ';
+		}
+		if (hl != NULL)
+			out = fmt_hl(out, hl, i, len, &state);
+		if (i < len) {
+			memcpy(out, hex_pair[buf[i]], 2);
+		} else {
+			out[0] = out[1] = ' ';
+		}
+		out += 2;
+	}
+	if (state)
+		out = fmt_hl(out, hl, len, len, &state);
+	memcpy(out, " | ", 3);
+	out += 3;
+	for (i = 0; i < width; ++i) {
+		if (hl != NULL)
+			out = fmt_hl(out, hl, i, len, &state);
+		*out++ = i < len ? print_map[buf[i]] : ' ';
+	}
+	if (state)
+		out = fmt_hl(out, hl, len, len, &state);
+	*out++ = '\n';
+	Out.len = out - Out.buf;
+}
+
+static inline void fmt_line(const char *tag, unsigned long long pos,
+    const unsigned char *buf, unsigned int len)
+{
+	fmt_line_hl(tag, pos, buf, len, NULL);
+}
+
+/**
+ * @path:	name of the file, for reopening it after rotation
+ * @base:	last component of @path
+ * @tag:	prefix for output lines, or %NULL when there is only one file
+ * @buf:	I/O buffer (independent of the line width)
+ * @cap:	size of @buf, a multiple of Opt.bsize
+ * @head:	offset of the first byte not yet printed
+ * @avail:	bytes from @head on that are not printed yet
+ * @pos:	file position of @buf[@head]
+ * @fd:		descriptor being read
+ * @wd:		inotify watch on the file itself, or -1
+ * @dwd:	watch on its directory, to see a new file take the name
+ * @rotated:	the file was renamed or deleted
+ * @queued:	in the ready queue
+ * @polled:	@fd (a pipe or such) is in the epoll set
+ */
+struct source {
+	const char *path, *base, *tag;
+	unsigned char *buf;
+	size_t cap, head, avail;
+	long long pos;
+	int fd, wd, dwd;
+	bool rotated, queued, polled;
+};
 
-	fstat(fd, &sb);
-	if (!Opt.start && Opt.approx)
-		Opt.start = (sb.st_size >> 8) << 8;
-	if (Opt.start < 0)
-		rax = lseek(fd, Opt.start, SEEK_END);
+/*
+ * All followed files share one inotify instance, which, together with
+ * any pipes, sits in one epoll set. Sources with data to read are
+ * processed from a FIFO queue, in the order the events came in.
+ */
+static struct source *Src;
+static unsigned int nr_src, *Queue, q_head, q_len;
+
+/* Preferred read size, rounded to a multiple of the line width */
+static const size_t io_size = 1 << 20;
+static int Inot = -1, Epfd = -1;
+
+static void queue_push(unsigned int i)
+{
+	if (Src[i].queued)
+		return;
+	Src[i].queued = true;
+	Queue[(q_head + q_len++) % nr_src] = i;
+}
+
+static bool queue_pop(unsigned int *i)
+{
+	if (q_len == 0)
+		return false;
+	*i = Queue[q_head];
+	q_head = (q_head + 1) % nr_src;
+	--q_len;
+	Src[*i].queued = false;
+	return true;
+}
+
+/**
+ * file_size - size of a regular file or block device
+ *
+ * st_size is 0 for block devices, so ask the driver.
+ */
+static long long file_size(int fd, const struct stat *sb)
+{
+	uint64_t bytes;
+	long long size;
+
+	if (!S_ISBLK(sb->st_mode))
+		return sb->st_size;
+	if (ioctl(fd, BLKGETSIZE64, &bytes) == 0)
+		return bytes;
+	size = lseek(fd, 0, SEEK_END);
+	return size < 0 ? 0 : size;
+}
+
+static int source_open(struct source *src, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	long long start = Opt.start;
+	struct stat sb;
+
+	src->path = path;
+	src->base = slash != NULL ? slash + 1 : path;
+	src->tag  = nr_src > 1 ? path : NULL;
+	src->wd   = src->dwd = -1;
+	src->cap  = (size_t)Opt.bsize > io_size ? (size_t)Opt.bsize :
+	            io_size - io_size % Opt.bsize;
+	src->buf  = malloc(src->cap);
+	if (src->buf == NULL) {
+		fprintf(stderr, "Could not allocate buffer of size %zu\n",
+		        src->cap);
+		return -1;
+	}
+	if ((src->fd = open(path, O_RDONLY)) < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (Opt.nr_ranges > 0)
+		return 0;
+	fstat(src->fd, &sb);
+	if (!start && Opt.approx)
+		start = (file_size(src->fd, &sb) >> 8) << 8;
+	if (start < 0 && S_ISBLK(sb.st_mode)) {
+		start += file_size(src->fd, &sb);
+		if (start < 0)
+			start = 0;
+	}
+	if (start < 0)
+		src->pos = lseek(src->fd, start, SEEK_END);
 	else
-		rax = lseek(fd, Opt.start, SEEK_SET);
-	if (rax < 0)
+		src->pos = lseek(src->fd, start, SEEK_SET);
+	if (src->pos < 0 && (start != 0 || errno != ESPIPE)) {
 		perror("seek to %lld failed");
+	}
+	if (src->pos < 0)
+		src->pos = 0;
+	return 0;
+}
 
-	while (true) {
-		long long pos;
-		int i;
+static void source_watch(struct source *src, unsigned int idx)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = idx};
+	char *dir, *slash;
+	struct stat sb;
 
-		pos = lseek(fd, 0, SEEK_CUR);
-		ret = read(fd, buf + buf_offset, Opt.bsize - buf_offset);
-		if (ret == 0) /* eof */
-			break;
+	if (fstat(src->fd, &sb) == 0 && !S_ISREG(sb.st_mode) &&
+	    !S_ISBLK(sb.st_mode)) {
+		/* Pipes and the like announce data through epoll directly */
+		src->polled = epoll_ctl(Epfd, EPOLL_CTL_ADD, src->fd, &ev) == 0;
+		if (src->polled)
+			fcntl(src->fd, F_SETFL,
+			      fcntl(src->fd, F_GETFL) | O_NONBLOCK);
+		return;
+	}
+	if (Inot < 0)
+		return;
+	src->wd = inotify_add_watch(Inot, src->path, IN_MODIFY | IN_ATTRIB |
+	          IN_MOVE_SELF | IN_DELETE_SELF);
+	dir = strdup(src->path);
+	if (dir == NULL)
+		return;
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+	src->dwd = inotify_add_watch(Inot, dir, IN_CREATE | IN_MOVED_TO);
+	free(dir);
+}
+
+/**
+ * source_read - format what is available from @src
+ * @budget:	maximum number of lines, 0 for no limit
+ *
+ * Reads go through the large I/O buffer; lines are then cut out of it.
+ * Returns true at EOF, false if the budget ran out first. Lines are only
+ * emitted once complete; at EOF, the partial one is kept in the buffer
+ * until the rest arrives (or source_partial is called).
+ */
+static bool source_read(struct source *src, unsigned int budget)
+{
+	ssize_t ret;
+
+	while (true) {
+		while (src->avail >= (size_t)Opt.bsize) {
+			fmt_line(src->tag, src->pos, src->buf + src->head,
+			         Opt.bsize);
+			src->pos   += Opt.bsize;
+			src->head  += Opt.bsize;
+			src->avail -= Opt.bsize;
+			if (budget > 0 && --budget == 0)
+				return false;
+		}
+		if (src->head > 0) {
+			memmove(src->buf, src->buf + src->head, src->avail);
+			src->head = 0;
+		}
+		ret = read(src->fd, src->buf + src->avail,
+		      src->cap - src->avail);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return true;
 		if (ret < 0) {
 			perror("read()");
 			exit(EXIT_FAILURE);
 		}
-		if (Opt.follow && ret < Opt.bsize) {
-			buf_offset = ret;
-			sched_yield();
+		if (ret == 0 && src->polled) {
+			/* Writer is gone; do not let EPOLLHUP spin us */
+			epoll_ctl(Epfd, EPOLL_CTL_DEL, src->fd, NULL);
+			src->polled = false;
+		}
+		if (ret == 0)
+			return true;
+		src->avail += ret;
+	}
+}
+
+/**
+ * source_partial - print the incomplete last line, if any
+ */
+static void source_partial(struct source *src)
+{
+	if (src->avail == 0)
+		return;
+	fmt_line(src->tag, src->pos, src->buf + src->head, src->avail);
+	src->pos  += src->avail;
+	src->head  = 0;
+	src->avail = 0;
+}
+
+/**
+ * @buf:	the two buffers, which the reader fills alternately
+ * @len:	bytes read into each buffer, or negative errno
+ * @full:	buffer holds data that has not been printed yet
+ */
+struct reader {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	size_t cap;
+	unsigned char *buf[2];
+	ssize_t len[2];
+	bool full[2];
+};
+
+static void *reader_main(void *arg)
+{
+	struct reader *rd = arg;
+	unsigned int i = 0;
+	ssize_t ret, len;
+
+	do {
+		pthread_mutex_lock(&rd->lock);
+		while (rd->full[i])
+			pthread_cond_wait(&rd->cond, &rd->lock);
+		pthread_mutex_unlock(&rd->lock);
+		ret = 0;
+		for (len = 0; len < (ssize_t)rd->cap; len += ret) {
+			ret = read(rd->fd, rd->buf[i] + len, rd->cap - len);
+			if (ret < 0 && errno == EINTR)
+				ret = 0;
+			else if (ret <= 0)
+				break;
+		}
+		if (ret < 0)
+			len = -errno;
+		pthread_mutex_lock(&rd->lock);
+		rd->len[i]  = len;
+		rd->full[i] = true;
+		pthread_cond_signal(&rd->cond);
+		pthread_mutex_unlock(&rd->lock);
+		i ^= 1;
+	} while (len == (ssize_t)rd->cap);
+	return NULL;
+}
+
+/**
+ * source_direct - switch a block device to O_DIRECT for source_dump
+ * @rd:		reader whose buffers are to be replaced by aligned ones
+ * @skip:	returns the distance from the aligned read start to @src->pos
+ *
+ * Dumping a disk should not push everything else out of the page cache.
+ * O_DIRECT needs buffers, offsets and lengths aligned to the logical
+ * block size, so reading starts at the block holding @src->pos.
+ */
+static bool source_direct(struct source *src, struct reader *rd,
+    size_t *skip)
+{
+	unsigned int align = 512;
+	long long base;
+	int ssz;
+
+	if (ioctl(src->fd, BLKSSZGET, &ssz) == 0 && ssz > 0)
+		align = ssz;
+	if (align < sysconf(_SC_PAGESIZE))
+		align = sysconf(_SC_PAGESIZE);
+	rd->cap = io_size;
+	if (posix_memalign((void **)&rd->buf[0], align, rd->cap) != 0)
+		return false;
+	if (posix_memalign((void **)&rd->buf[1], align, rd->cap) != 0 ||
+	    fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) | O_DIRECT) < 0) {
+		free(rd->buf[0]);
+		free(rd->buf[1]);
+		return false;
+	}
+	base  = src->pos - src->pos % align;
+	*skip = src->pos - base;
+	if (lseek(src->fd, base, SEEK_SET) != base) {
+		fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL) & ~O_DIRECT);
+		lseek(src->fd, src->pos, SEEK_SET);
+		free(rd->buf[0]);
+		free(rd->buf[1]);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * source_dump - print a file from its current position to EOF
+ *
+ * For files and block devices, a reader thread fills one buffer while
+ * the other is being formatted. Each buffer but the last is full, and
+ * thus a whole number of lines. Pipes are read directly, so that output
+ * is not held back until a buffer fills.
+ *
+ * Block devices are read with O_DIRECT (unless --cached), from an aligned
+ * position; there, lines can straddle buffers and are put together in
+ * @src->buf.
+ */
+static int source_dump(struct source *src)
+{
+	struct reader rd = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.fd   = src->fd,
+		.cap  = src->cap,
+		.buf  = {src->buf},
+	};
+	size_t off, n, skip = 0, fill = 0;
+	bool direct = false;
+	unsigned int i = 0;
+	pthread_t tid;
+	struct stat sb;
+	ssize_t len;
+
+	if (fstat(src->fd, &sb) < 0 ||
+	    (!S_ISREG(sb.st_mode) && !S_ISBLK(sb.st_mode)))
+		goto fallback;
+	if (S_ISBLK(sb.st_mode) && !Opt.cached)
+		direct = source_direct(src, &rd, &skip);
+	if (!direct && (rd.buf[1] = malloc(rd.cap)) == NULL)
+		goto fallback;
+	if (pthread_create(&tid, NULL, reader_main, &rd) != 0) {
+		if (direct)
+			free(rd.buf[0]);
+		free(rd.buf[1]);
+		goto fallback;
+	}
+	do {
+		pthread_mutex_lock(&rd.lock);
+		while (!rd.full[i])
+			pthread_cond_wait(&rd.cond, &rd.lock);
+		len = rd.len[i];
+		pthread_mutex_unlock(&rd.lock);
+		for (off = skip; len > 0 && off < (size_t)len; off += n) {
+			n = (size_t)len - off < (size_t)Opt.bsize - fill ?
+			    (size_t)len - off : (size_t)Opt.bsize - fill;
+			if (fill == 0 && (n == (size_t)Opt.bsize ||
+			    len < (ssize_t)rd.cap)) {
+				fmt_line(src->tag, src->pos, rd.buf[i] + off, n);
+				src->pos += n;
+				continue;
+			}
+			/* Line straddles two buffers */
+			memcpy(src->buf + fill, rd.buf[i] + off, n);
+			fill += n;
+			if (fill < (size_t)Opt.bsize)
+				continue;
+			fmt_line(src->tag, src->pos, src->buf, fill);
+			src->pos += fill;
+			fill = 0;
+		}
+		skip = 0;
+		pthread_mutex_lock(&rd.lock);
+		rd.full[i] = false;
+		pthread_cond_signal(&rd.cond);
+		pthread_mutex_unlock(&rd.lock);
+		i ^= 1;
+	} while (len == (ssize_t)rd.cap);
+	pthread_join(tid, NULL);
+	if (fill > 0) {
+		fmt_line(src->tag, src->pos, src->buf, fill);
+		src->pos += fill;
+	}
+	if (direct)
+		free(rd.buf[0]);
+	free(rd.buf[1]);
+	if (len < 0) {
+		fprintf(stderr, "read %s: %s\n", src->path, strerror(-len));
+		return -1;
+	}
+	return 0;
+
+ fallback:
+	source_read(src, 0);
+	source_partial(src);
+	return 0;
+}
+
+/**
+ * source_check - deal with truncation and rotation at EOF
+ *
+ * Returns true if reading should restart from the beginning of a
+ * (possibly new) file.
+ */
+static bool source_check(struct source *src, unsigned int idx)
+{
+	struct stat sb, nsb;
+	int fd;
+
+	if (fstat(src->fd, &sb) < 0)
+		return false;
+	if (S_ISREG(sb.st_mode) && sb.st_size <
+	    src->pos + (long long)src->avail) {
+		out_flush();
+		fprintf(stderr, "tailhex: %s: file truncated\n", src->path);
+		lseek(src->fd, 0, SEEK_SET);
+		src->pos   = 0;
+		src->head  = 0;
+		src->avail = 0;
+		return true;
+	}
+	if (!src->rotated)
+		return false;
+	fd = open(src->path, O_RDONLY);
+	if (fd < 0)
+		/* Not recreated yet; the directory watch will tell */
+		return false;
+	if (fstat(fd, &nsb) == 0 && nsb.st_dev == sb.st_dev &&
+	    nsb.st_ino == sb.st_ino) {
+		close(fd);
+		src->rotated = false;
+		return false;
+	}
+	/* The old file's last line will not be completed anymore */
+	source_partial(src);
+	out_flush();
+	fprintf(stderr, "tailhex: %s: file replaced, following new file\n",
+	        src->path);
+	close(src->fd);
+	if (src->wd >= 0)
+		inotify_rm_watch(Inot, src->wd);
+	src->fd      = fd;
+	src->pos     = 0;
+	src->rotated = false;
+	src->wd      = -1;
+	source_watch(src, idx);
+	return true;
+}
+
+/**
+ * follow_wait - sleep until some followed file has changed
+ *
+ * Without inotify, regular files are checked once a second.
+ */
+static void follow_wait(void)
+{
+	char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *e;
+	struct epoll_event pev[64];
+	unsigned int i;
+	struct stat sb;
+	ssize_t ret;
+	int n, j;
+	char *p;
+
+	n = epoll_wait(Epfd, pev, ARRAY_SIZE(pev), Inot < 0 ? 1000 : -1);
+	if (n == 0)
+		for (i = 0; i < nr_src; ++i)
+			if (!Src[i].polled)
+				queue_push(i);
+	for (j = 0; j < n; ++j) {
+		if (pev[j].data.u32 < nr_src) {
+			queue_push(pev[j].data.u32);
 			continue;
 		}
+		ret = read(Inot, ev, sizeof(ev));
+		for (p = ev; ret > 0 && p < ev + ret; p += sizeof(*e) + e->len) {
+			e = (const void *)p;
+			for (i = 0; i < nr_src; ++i) {
+				struct source *src = &Src[i];
 
-		buf_offset = 0;
-		if (Opt.quad || pos > (long long)0xFFFFFFFF)
-			printf("0x%016llx |", pos);
+				if (e->wd == src->wd && (e->mask &
+				    (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)))
+					src->rotated = true;
+				else if (e->wd == src->wd &&
+				    (e->mask & IN_ATTRIB) &&
+				    fstat(src->fd, &sb) == 0 &&
+				    sb.st_nlink == 0)
+					src->rotated = true;
+				else if (e->wd == src->dwd && e->len > 0 &&
+				    strcmp(e->name, src->base) == 0)
+					/* A new file took the name */
+					src->rotated = true;
+				else if (e->wd != src->wd)
+					continue;
+				queue_push(i);
+			}
+		}
+	}
+}
+
+static int follow_init(void)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = UINT32_MAX};
+	unsigned int i;
+
+	Epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (Epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	Inot = inotify_init1(IN_CLOEXEC);
+	if (Inot >= 0 && epoll_ctl(Epfd, EPOLL_CTL_ADD, Inot, &ev) < 0) {
+		close(Inot);
+		Inot = -1;
+	}
+	for (i = 0; i < nr_src; ++i)
+		source_watch(&Src[i], i);
+	return 0;
+}
+
+/**
+ * range_dump - print [@start, @end) of @fd
+ *
+ * The range is mapped in windows of a multiple of both the page size and
+ * the line width, so only the pages that are printed are ever faulted in
+ * and no line straddles two windows. If the file cannot be mapped (e.g.
+ * procfs), pread is used instead.
+ */
+static int range_dump(const struct source *src, long long start,
+    long long end)
+{
+	const long long page = sysconf(_SC_PAGESIZE);
+	const long long win = (long long)Opt.bsize * page *
+	                      ((16 << 20) / page / Opt.bsize + 1);
+	unsigned char *buf = NULL, *area;
+	long long pos, wend, moff;
+	size_t mlen, i;
+	ssize_t ret;
+
+	for (pos = start; pos < end; pos = wend) {
+		wend = end - pos > win ? pos + win : end;
+		moff = pos & ~(page - 1);
+		mlen = wend - moff;
+		area = buf != NULL ? MAP_FAILED :
+		       mmap(NULL, mlen, PROT_READ, MAP_SHARED, src->fd, moff);
+		if (area != MAP_FAILED) {
+			madvise(area, mlen, MADV_SEQUENTIAL);
+			for (i = pos - moff; i < mlen; i += Opt.bsize)
+				fmt_line(src->tag, moff + i, area + i, mlen - i <
+				         (size_t)Opt.bsize ? mlen - i : Opt.bsize);
+			munmap(area, mlen);
+			continue;
+		}
+		if (buf == NULL && (buf = malloc(win)) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		ret = pread(src->fd, buf, wend - pos, pos);
+		if (ret < 0) {
+			perror("pread");
+			free(buf);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+		wend = pos + ret;
+		for (i = 0; i < (size_t)ret; i += Opt.bsize)
+			fmt_line(src->tag, pos + i, buf + i,
+			         ret - i < (size_t)Opt.bsize ? ret - i : Opt.bsize);
+	}
+	free(buf);
+	return 0;
+}
+
+/**
+ * ranges_dump - print all --range arguments in the order given
+ */
+static int ranges_dump(const struct source *src)
+{
+	long long size, start, end;
+	const struct range *r;
+	unsigned int i;
+	struct stat sb;
+	int ret = 0;
+
+	if (fstat(src->fd, &sb) < 0) {
+		perror("fstat");
+		return -1;
+	}
+	size = file_size(src->fd, &sb);
+	for (i = 0; i < Opt.nr_ranges && ret == 0; ++i) {
+		r     = &Opt.ranges[i];
+		start = r->start < 0 ? size + r->start : r->start;
+		if (start < 0)
+			start = 0;
+		if (r->end == LLONG_MAX)
+			end = size;
+		else if (r->rel)
+			end = r->end > LLONG_MAX - start ? LLONG_MAX :
+			      start + r->end;
 		else
-			printf("0x%08llx |", pos);
+			end = r->end;
+		if (end > size)
+			end = size;
+		if (start < end)
+			ret = range_dump(src, start, end);
+	}
+	return ret;
+}
+
+/**
+ * find_next - locate the next occurrence of the --find pattern
+ *
+ * On x86_64, 16 candidate positions at a time are filtered by comparing
+ * both the first and the last byte of the pattern (SSE2), which rejects
+ * nearly everything before a full comparison is needed.
+ */
+static const unsigned char *find_next(const unsigned char *hay, size_t n)
+{
+	const unsigned char *pat = Opt.pattern;
+	size_t plen = Opt.pattern_len, i = 0;
 
-		for (i = 0; i < Opt.bsize; ++i) {
-			printf(" ");
-			if (i < ret)   printf("%02x", (int)buf[i]);
-			else           printf("  ");
-			if (++i < ret) printf("%02x", (int)buf[i]);
-			else           printf("  ");
+	if (plen == 1)
+		return memchr(hay, *pat, n);
+#if defined(__x86_64__)
+	{
+		const __m128i first = _mm_set1_epi8(pat[0]);
+		const __m128i last  = _mm_set1_epi8(pat[plen-1]);
+		unsigned int mask, bit;
+
+		for (; i + plen - 1 + 16 <= n; i += 16) {
+			mask = _mm_movemask_epi8(_mm_and_si128(
+			       _mm_cmpeq_epi8(first, _mm_loadu_si128(
+			       (const __m128i *)(hay + i))),
+			       _mm_cmpeq_epi8(last, _mm_loadu_si128(
+			       (const __m128i *)(hay + i + plen - 1)))));
+			for (; mask != 0; mask &= mask - 1) {
+				bit = __builtin_ctz(mask);
+				if (memcmp(hay + i + bit + 1, pat + 1,
+				    plen - 2) == 0)
+					return hay + i + bit;
+			}
 		}
-		printf(" | ");
+	}
+#endif
+	return i < n ? memmem(hay + i, n - i, pat, plen) : NULL;
+}
 
-		for (i = 0; i < Opt.bsize; ++i) {
-			if (i < ret)   printf("%c", printable(buf[i]));
-			else           printf(" ");
-			if (++i < ret) printf("%c", printable(buf[i]));
-			else           printf(" ");
+/**
+ * @buf:	data from file position @base onwards
+ * @len:	valid bytes in @buf
+ * @cap:	size of @buf
+ * @origin:	position of the first line; lines are Opt.bsize apart
+ * @printed:	lines before this position have been dealt with
+ * @until:	lines before this position are still to be printed
+ * @hits:	start of the matches that may still need highlighting
+ * @nr_hits:	entries in @hits
+ * @any:	something was printed (a separator goes before the next group)
+ */
+struct finder {
+	const struct source *src;
+	unsigned char *buf;
+	size_t len, cap;
+	long long base, origin, printed, until;
+	long long *hits;
+	size_t nr_hits, max_hits;
+	bool any;
+};
+
+static inline long long find_line(const struct finder *f, long long pos)
+{
+	return pos - (pos - f->origin) % Opt.bsize;
+}
+
+/**
+ * find_emit - print the pending lines that lie before @end
+ */
+static void find_emit(struct finder *f, long long end, unsigned char *hl)
+{
+	long long pos, hs;
+	size_t i, j, n;
+
+	if (end > f->until)
+		end = f->until;
+	for (pos = f->printed; pos < end; pos += Opt.bsize) {
+		n = f->base + f->len - pos < Opt.bsize ?
+		    f->base + f->len - pos : Opt.bsize;
+		memset(hl, 0, Opt.bsize);
+		for (i = 0; i < f->nr_hits; ++i) {
+			hs = f->hits[i];
+			if (hs >= pos + (long long)n ||
+			    hs + (long long)Opt.pattern_len <= pos)
+				continue;
+			for (j = 0; j < Opt.pattern_len; ++j)
+				if (hs + (long long)j >= pos &&
+				    hs + (long long)j < pos + (long long)n)
+					hl[hs+j-pos] = 1;
+		}
+		fmt_line_hl(f->src->tag, pos, f->buf + (pos - f->base), n,
+		            Opt.color ? hl : NULL);
+		f->any = true;
+	}
+	if (pos > f->printed)
+		f->printed = pos;
+}
+
+/**
+ * find_hit - handle a match at position @hit
+ *
+ * Pending lines before the new group are printed first; they cannot
+ * contain this or any later hit.
+ */
+static int find_hit(struct finder *f, long long hit, unsigned char *hl)
+{
+	long long ctx = (long long)Opt.context * Opt.bsize, first, last;
+	long long *nh;
+
+	first = find_line(f, hit) - ctx;
+	last  = find_line(f, hit + Opt.pattern_len - 1) + Opt.bsize + ctx;
+	if (first < f->origin)
+		first = f->origin;
+	find_emit(f, first, hl);
+	if (first > f->printed) {
+		/* Not adjacent to what came before */
+		if (f->any) {
+			if (Out.size - Out.len < 4)
+				out_flush();
+			memcpy(Out.buf + Out.len, "--\n", 3);
+			Out.len += 3;
 		}
-		printf("\n");
+		f->printed = first;
+	}
+	if (last > f->until)
+		f->until = last;
+	if (f->nr_hits == f->max_hits) {
+		f->max_hits = f->max_hits * 2 + 16;
+		nh = realloc(f->hits, f->max_hits * sizeof(*nh));
+		if (nh == NULL)
+			return -errno;
+		f->hits = nh;
 	}
+	f->hits[f->nr_hits++] = hit;
+	return 0;
+}
 
+/**
+ * find_scan - print the lines of @src that contain the --find pattern
+ *
+ * Data is streamed through a large buffer. Only matches that start before
+ * the search horizon (where a full pattern still fits into the buffer) are
+ * looked for, and only lines that end before it are printed, so that all
+ * the hits they contain are known. What is still needed (unsearched tail,
+ * lines of leading context, pending lines) is kept for the next round.
+ */
+static int find_scan(const struct source *src)
+{
+	const size_t chunk = 4 << 20;
+	struct finder f = {.src = src};
+	long long horizon, end, keep, s;
+	const unsigned char *m;
+	unsigned char *hl;
+	bool eof = false;
+	ssize_t ret;
+	int err = 0;
+
+	f.cap    = chunk + (2 * Opt.context + 2) * Opt.bsize +
+	           2 * Opt.pattern_len;
+	f.buf    = malloc(f.cap);
+	hl       = malloc(Opt.bsize);
+	f.base   = f.origin = f.printed = f.until = horizon = src->pos;
+	if (f.buf == NULL || hl == NULL) {
+		free(f.buf);
+		free(hl);
+		return -ENOMEM;
+	}
+	while (!eof) {
+		while (f.len < f.cap) {
+			ret = read(src->fd, f.buf + f.len, f.cap - f.len);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0) {
+				err = -errno;
+				goto out;
+			}
+			if (ret == 0) {
+				eof = true;
+				break;
+			}
+			f.len += ret;
+		}
+		end = f.base + f.len;
+		if (!eof)
+			end -= Opt.pattern_len - 1;
+		for (s = horizon; s < end; s = m - f.buf + f.base + 1) {
+			m = find_next(f.buf + (s - f.base),
+			    end - s + (eof ? 0 : Opt.pattern_len - 1));
+			if (m == NULL)
+				break;
+			err = find_hit(&f, m - f.buf + f.base, hl);
+			if (err < 0)
+				goto out;
+		}
+		horizon = end;
+		find_emit(&f, eof ? end : find_line(&f, end), hl);
+		if (eof)
+			break;
+
+		/* Keep leading context for the next hit, and pending lines */
+		keep = find_line(&f, horizon) - (long long)Opt.context * Opt.bsize;
+		if (f.until > f.printed && f.printed < keep)
+			keep = f.printed;
+		if (keep < f.base)
+			keep = f.base;
+		memmove(f.buf, f.buf + (keep - f.base), f.base + f.len - keep);
+		f.len -= keep - f.base;
+		f.base = keep;
+		/* Drop hits that no line to be printed can contain anymore */
+		for (s = 0; s < (long long)f.nr_hits &&
+		     f.hits[s] + (long long)Opt.pattern_len <= f.printed; ++s)
+			;
+		memmove(f.hits, f.hits + s, (f.nr_hits - s) * sizeof(*f.hits));
+		f.nr_hits -= s;
+	}
+ out:
+	free(f.hits);
+	free(f.buf);
+	free(hl);
+	return err;
+}
+
+static int main2(int argc, const char **argv)
+{
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	if (get_options(&argc, &argv) <= 0)
+		return EXIT_FAILURE;
+	if (!out_init()) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+	fmt_init();
+
+	nr_src = argc - 1;
+	Src    = calloc(nr_src, sizeof(*Src));
+	Queue  = calloc(nr_src, sizeof(*Queue));
+	if (Src == NULL || Queue == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < nr_src; ++i)
+		if (source_open(&Src[i], argv[i+1]) < 0)
+			return EXIT_FAILURE;
+
+	if (Opt.nr_ranges > 0) {
+		for (i = 0; i < nr_src && ret == EXIT_SUCCESS; ++i)
+			if (ranges_dump(&Src[i]) < 0)
+				ret = EXIT_FAILURE;
+		out_flush();
+		return ret;
+	}
+	if (Opt.pattern != NULL) {
+		for (i = 0; i < nr_src && ret == EXIT_SUCCESS; ++i) {
+			int err = find_scan(&Src[i]);
+
+			if (err < 0) {
+				fprintf(stderr, "%s: %s\n", Src[i].path,
+				        strerror(-err));
+				ret = EXIT_FAILURE;
+			}
+		}
+		out_flush();
+		return ret;
+	}
+	if (!Opt.follow) {
+		for (i = 0; i < nr_src; ++i)
+			if (source_dump(&Src[i]) < 0)
+				ret = EXIT_FAILURE;
+		out_flush();
+		return ret;
+	}
+	if (follow_init() < 0)
+		return EXIT_FAILURE;
+
+	for (i = 0; i < nr_src; ++i)
+		queue_push(i);
+	while (true) {
+		while (queue_pop(&i)) {
+			/* Take turns, so that no file hogs the output */
+			if (!source_read(&Src[i], 256)) {
+				queue_push(i);
+				continue;
+			}
+			if (source_check(&Src[i], i))
+				queue_push(i);
+		}
+		out_flush();
+		follow_wait();
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -7,143 +7,3275 @@
  *	(at your option) any later version.
  */
 #define _GNU_SOURCE 1
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <libHX/defs.h>
 #include <libHX/init.h>
 #include <libHX/option.h>
+#include <libHX/string.h>
+#include <linux/fs.h>
+#include "config.h"
+#ifdef HAVE_LINUX_IO_URING_H
+#	include <linux/io_uring.h>
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#	define IOPRIO_CLASS_SHIFT 13
+#	define IOPRIO_WHO_PROCESS 1
+#endif
 
 enum {
+	XCP_AUTO,
 	XCP_MMAP,
 	XCP_SPLICE,
+	XCP_URING,
+	XCP_REFLINK,
+	XCP_COPY_RANGE,
+	XCP_DIRECT,
 };
 
-static unsigned int xcp_mode = XCP_MMAP;
+enum {
+	XCP_HASH_NONE,
+	XCP_HASH_CRC32C,
+	XCP_HASH_SHA256,
+};
+
+/**
+ * @ifd:	source descriptor
+ * @ofd:	destination descriptor
+ * @xfd:	further destinations that receive the same data (fan-out)
+ * @nxfd:	number of entries in @xfd
+ * @size:	source size
+ * @start:	offset to start copying at (--resume)
+ * @copied:	bytes written to the destination so far
+ * @sparse:	whether holes may be skipped (destinations are regular files)
+ * @stream:	some destination is not seekable (pipe, socket, tty)
+ * @what:	operation that failed, for the error message
+ * @priv:	engine-private state
+ * @jfd:	--resume journal, or -1
+ * @jpath:	path of the journal
+ * @hash:	running checksum of the source data, or %NULL
+ */
+struct xcp_job {
+	int ifd, ofd, jfd, *xfd;
+	unsigned int nxfd;
+	off_t size, start, copied;
+	bool sparse, stream;
+	const char *what;
+	void *priv;
+	char *jpath;
+	struct xcp_hash *hash;
+};
+
+/**
+ * @name:	engine name for messages
+ * @setup:	(optional) prepare @job->priv
+ * @copy:	copy the given range to the same offset in the destination;
+ * 		returns 0 on success or negative errno
+ * @teardown:	(optional) release @job->priv
+ * @whole:	engine can only copy whole files (no extent walk)
+ * @hashes:	engine sees the data in order and can feed --hash
+ * @fanout:	engine can write to @xfd as well from a single read
+ * @throttles:	engine honors --bwlimit and --iops-limit
+ */
+struct xcp_engine {
+	const char *name;
+	int (*setup)(struct xcp_job *);
+	int (*copy)(struct xcp_job *, off_t, off_t);
+	void (*teardown)(struct xcp_job *);
+	bool whole, hashes, fanout, throttles;
+};
+
+static unsigned int xcp_mode = XCP_AUTO, xcp_verbose, xcp_recursive;
+static unsigned int xcp_depth = 16, xcp_jobs;
+static unsigned int xcp_resume, xcp_hash_type, xcp_verify;
+static unsigned int xcp_stats_on, xcp_bench_on;
+static unsigned long long xcp_bench_size = 256 << 20;
+static unsigned long long xcp_chunk = 1 << 20, xcp_window = 64 << 20;
+static unsigned long long xcp_ckpt_size = 256 << 20;
+static unsigned long long xcp_bwlimit;
+static unsigned int xcp_iops_limit, xcp_io_max;
+static int xcp_ioprio = -1;
+/* Set by option callbacks that were given an unusable argument */
+static bool xcp_opt_error;
+
+/**
+ * xcp_parse_size - parse a byte count with optional k/M/G/T suffix
+ */
+static unsigned long long xcp_parse_size(const char *str, bool *ok)
+{
+	unsigned long long ret, mult = 1;
+	char *end;
+
+	errno = 0;
+	ret = strtoull(str, &end, 0);
+	*ok = end != str && errno == 0 && *str != '-';
+	switch (*end) {
+	case 'T': case 't': mult <<= 10; /* fallthrough */
+	case 'G': case 'g': mult <<= 10; /* fallthrough */
+	case 'M': case 'm': mult <<= 10; /* fallthrough */
+	case 'K': case 'k': mult <<= 10; ++end; break;
+	}
+	if (*end != '\0' || ret > ULLONG_MAX / mult)
+		*ok = false;
+	return ret * mult;
+}
+
+static void xcp_getopt_size(const struct HXoptcb *cbi)
+{
+	unsigned long long *ptr = cbi->current->uptr;
+	bool ok;
+
+	*ptr = xcp_parse_size(cbi->data, &ok);
+	if (!ok) {
+		fprintf(stderr, "Invalid size \"%s\"\n", cbi->data);
+		xcp_opt_error = true;
+	}
+}
+
+static void xcp_getopt_hash(const struct HXoptcb *cbi)
+{
+	if (strcmp(cbi->data, "crc32c") == 0)
+		xcp_hash_type = XCP_HASH_CRC32C;
+	else if (strcmp(cbi->data, "sha256") == 0)
+		xcp_hash_type = XCP_HASH_SHA256;
+	else {
+		fprintf(stderr, "Unknown hash \"%s\"\n", cbi->data);
+		xcp_opt_error = true;
+	}
+}
+
+/**
+ * xcp_getopt_ioprio - parse --ioprio CLASS[:LEVEL]
+ */
+static void xcp_getopt_ioprio(const struct HXoptcb *cbi)
+{
+	static const char *const classes[] = {
+		[1] = "realtime", [2] = "best-effort", [3] = "idle",
+	};
+	unsigned int cls, level = 4;
+	const char *colon;
+	size_t len;
+	char *end;
+
+	colon = strchr(cbi->data, ':');
+	len   = colon != NULL ? (size_t)(colon - cbi->data) :
+	        strlen(cbi->data);
+	for (cls = 1; cls < ARRAY_SIZE(classes); ++cls)
+		if (len > 0 && strncmp(cbi->data, classes[cls], len) == 0)
+			break;
+	if (cls == ARRAY_SIZE(classes)) {
+		fprintf(stderr, "Unknown I/O class \"%s\"\n", cbi->data);
+		xcp_opt_error = true;
+		return;
+	}
+	if (colon != NULL) {
+		level = strtoul(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0' || level > 7) {
+			fprintf(stderr, "I/O priority level must be 0..7\n");
+			xcp_opt_error = true;
+			return;
+		}
+	}
+	/* The idle class has no levels */
+	xcp_ioprio = cls << IOPRIO_CLASS_SHIFT | (cls == 3 ? 0 : level);
+}
+
+static bool xcp_get_options(int *argc, const char ***argv)
+{
+	static struct HXoption options_table[] = {
+		{.sh = 'a', .ln = "auto", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_AUTO,
+		 .help = "Try reflink, copy_file_range, splice, mmap in turn"},
+		{.sh = 'c', .ln = "copy-range", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_COPY_RANGE,
+		 .help = "Use copy_file_range(2) for copying"},
+		{.sh = 'd', .ln = "direct", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_DIRECT,
+		 .help = "Use O_DIRECT, bypassing the page cache"},
+		{.sh = 'm', .ln = "mmap", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_MMAP,
+		 .help = "Use mmap(2) for copying"},
+		{.sh = 's', .ln = "splice", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_SPLICE,
+		 .help = "Use splice(2) for copying"},
+		{.sh = 'R', .ln = "recursive", .ptr = &xcp_recursive,
+		 .type = HXTYPE_NONE,
+		 .help = "Copy directory trees, preserving metadata"},
+		{.sh = 'j', .ln = "jobs", .ptr = &xcp_jobs, .type = HXTYPE_UINT,
+		 .help = "Number of copy threads for -R (default: auto)",
+		 .htyp = "N"},
+		{.ln = "hash", .type = HXTYPE_STRING, .cb = xcp_getopt_hash,
+		 .help = "Checksum the data while copying (crc32c, sha256)",
+		 .htyp = "ALGO"},
+		{.ln = "verify", .ptr = &xcp_verify, .type = HXTYPE_NONE,
+		 .help = "Re-read the destination and compare checksums"},
+		{.ln = "stats", .ptr = &xcp_stats_on, .type = HXTYPE_NONE,
+		 .help = "Report throughput, syscalls and latencies"},
+		{.ln = "bench", .ptr = &xcp_bench_on, .type = HXTYPE_NONE,
+		 .help = "Compare all modes on a scratch file in [DIR]"},
+		{.ln = "bench-size", .uptr = &xcp_bench_size,
+		 .type = HXTYPE_STRING, .cb = xcp_getopt_size,
+		 .help = "Size of the --bench scratch file", .htyp = "BYTES"},
+		{.ln = "resume", .ptr = &xcp_resume, .type = HXTYPE_NONE,
+		 .help = "Continue an interrupted copy (keeps a journal)"},
+		{.ln = "checkpoint", .uptr = &xcp_ckpt_size,
+		 .type = HXTYPE_STRING, .cb = xcp_getopt_size,
+		 .help = "Sync and journal every so many bytes (--resume)",
+		 .htyp = "BYTES"},
+		{.sh = 'r', .ln = "reflink", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_REFLINK,
+		 .help = "Share the source's extents (FICLONE)"},
+		{.sh = 'u', .ln = "uring", .ptr = &xcp_mode,
+		 .type = HXTYPE_VAL, .val = XCP_URING,
+		 .help = "Use io_uring(7) with a queue of fixed buffers"},
+		{.sh = 'v', .ln = "verbose", .ptr = &xcp_verbose,
+		 .type = HXTYPE_NONE, .help = "Report the engine used"},
+		{.ln = "depth", .ptr = &xcp_depth, .type = HXTYPE_UINT,
+		 .help = "Number of buffers in flight (uring, direct)",
+		 .htyp = "N"},
+		{.ln = "chunk", .uptr = &xcp_chunk, .type = HXTYPE_STRING,
+		 .cb = xcp_getopt_size,
+		 .help = "Size of each buffer (uring, direct)", .htyp = "BYTES"},
+		{.ln = "window", .uptr = &xcp_window, .type = HXTYPE_STRING,
+		 .cb = xcp_getopt_size,
+		 .help = "Size of the sliding mapping (mmap)", .htyp = "BYTES"},
+		{.ln = "bwlimit", .uptr = &xcp_bwlimit, .type = HXTYPE_STRING,
+		 .cb = xcp_getopt_size,
+		 .help = "Limit throughput to BYTES per second",
+		 .htyp = "BYTES"},
+		{.ln = "iops-limit", .ptr = &xcp_iops_limit,
+		 .type = HXTYPE_UINT,
+		 .help = "Limit the number of I/O requests per second",
+		 .htyp = "N"},
+		{.ln = "ioprio", .type = HXTYPE_STRING,
+		 .cb = xcp_getopt_ioprio,
+		 .help = "I/O scheduling class (realtime, best-effort, idle)",
+		 .htyp = "CLASS[:LEVEL]"},
+		{.ln = "io-max", .ptr = &xcp_io_max, .type = HXTYPE_NONE,
+		 .help = "Also put the limits into the cgroup's io.max"},
+		HXOPT_AUTOHELP,
+		HXOPT_TABLEEND,
+	};
+	if (HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) !=
+	    HXOPT_ERR_SUCCESS || xcp_opt_error)
+		return false;
+	if (xcp_verify && xcp_hash_type == XCP_HASH_NONE)
+		xcp_hash_type = XCP_HASH_CRC32C;
+	if (xcp_io_max && xcp_bwlimit == 0 && xcp_iops_limit == 0) {
+		fprintf(stderr, "--io-max needs --bwlimit or --iops-limit\n");
+		return false;
+	}
+	if (xcp_ckpt_size == 0) {
+		fprintf(stderr, "Checkpoint interval must not be 0\n");
+		return false;
+	}
+	if (xcp_depth == 0 || xcp_chunk == 0 || xcp_chunk > 1U << 30) {
+		fprintf(stderr, "Queue depth and chunk size must be "
+		        "between 1 and 1G\n");
+		return false;
+	}
+	/* Keep subsequent windows page-aligned */
+	xcp_window += sysconf(_SC_PAGESIZE) - 1;
+	xcp_window &= ~(unsigned long long)(sysconf(_SC_PAGESIZE) - 1);
+	if (xcp_window == 0 || xcp_window > SIZE_MAX / 2) {
+		fprintf(stderr, "Invalid window size\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ *	Checksums computed while copying
+ */
+static const uint32_t xcp_sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t xcp_crc32c_table[8][256];
+
+/**
+ * @type:	XCP_HASH_*
+ * @pos:	number of bytes hashed so far
+ * @crc:	CRC32C state
+ * @h, @block, @fill:	SHA-256 state
+ */
+struct xcp_hash {
+	unsigned int type;
+	off_t pos;
+	uint32_t crc;
+	uint32_t h[8];
+	unsigned char block[64];
+	unsigned int fill;
+};
+
+static uint32_t (*xcp_crc32c)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t xcp_crc32c_sw(uint32_t crc, const unsigned char *p,
+    size_t len)
+{
+	/* slicing-by-8 */
+	for (; len >= 8; p += 8, len -= 8) {
+		crc ^= p[0] | (p[1] << 8) | (p[2] << 16) |
+		       ((uint32_t)p[3] << 24);
+		crc = xcp_crc32c_table[7][crc & 0xff] ^
+		      xcp_crc32c_table[6][(crc >> 8) & 0xff] ^
+		      xcp_crc32c_table[5][(crc >> 16) & 0xff] ^
+		      xcp_crc32c_table[4][crc >> 24] ^
+		      xcp_crc32c_table[3][p[4]] ^ xcp_crc32c_table[2][p[5]] ^
+		      xcp_crc32c_table[1][p[6]] ^ xcp_crc32c_table[0][p[7]];
+	}
+	while (len-- > 0)
+		crc = xcp_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+/* Uses the SSE4.2 CRC32 instruction, which implements the CRC32C polynomial */
+__attribute__((target("sse4.2")))
+static uint32_t xcp_crc32c_sse42(uint32_t crc, const unsigned char *p,
+    size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len > 0 && ((uintptr_t)p & 7) != 0; --len)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+	for (; len > 0; --len)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return c;
+}
+#endif
+
+static void xcp_crc32c_init(void)
+{
+	unsigned int i, j;
+	uint32_t c;
+
+	for (i = 0; i < 256; ++i) {
+		c = i;
+		for (j = 0; j < 8; ++j)
+			c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+		xcp_crc32c_table[0][i] = c;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			xcp_crc32c_table[j][i] =
+				(xcp_crc32c_table[j-1][i] >> 8) ^
+				xcp_crc32c_table[0][xcp_crc32c_table[j-1][i] & 0xff];
+	xcp_crc32c = xcp_crc32c_sw;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		xcp_crc32c = xcp_crc32c_sse42;
+#endif
+}
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void xcp_sha256_block(uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	unsigned int i;
+
+	for (i = 0; i < 16; ++i)
+		w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i+1] << 16) |
+		       (p[4*i+2] << 8) | p[4*i+3];
+	for (; i < 64; ++i)
+		w[i] = w[i-16] + w[i-7] +
+		       (ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3)) +
+		       (ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10));
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; ++i) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+		     ((e & f) ^ (~e & g)) + xcp_sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+#undef ROR
+
+static void xcp_hash_init(struct xcp_hash *hash)
+{
+	static const uint32_t sha256_iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	hash->pos  = 0;
+	hash->crc  = ~0U;
+	hash->fill = 0;
+	memcpy(hash->h, sha256_iv, sizeof(sha256_iv));
+}
+
+static void xcp_hash_update(struct xcp_hash *hash, const void *vp, size_t len)
+{
+	const unsigned char *p = vp;
+	size_t n;
+
+	hash->pos += len;
+	if (hash->type == XCP_HASH_CRC32C) {
+		hash->crc = xcp_crc32c(hash->crc, p, len);
+		return;
+	}
+	if (hash->fill > 0) {
+		n = 64 - hash->fill;
+		if (n > len)
+			n = len;
+		memcpy(hash->block + hash->fill, p, n);
+		hash->fill += n;
+		p   += n;
+		len -= n;
+		if (hash->fill < 64)
+			return;
+		xcp_sha256_block(hash->h, hash->block);
+		hash->fill = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		xcp_sha256_block(hash->h, p);
+	memcpy(hash->block, p, len);
+	hash->fill = len;
+}
+
+/**
+ * xcp_hash_seek - account for a hole by hashing zeroes up to @off
+ */
+static void xcp_hash_seek(struct xcp_hash *hash, off_t off)
+{
+	static const char zero[65536];
+
+	while (hash->pos < off)
+		xcp_hash_update(hash, zero, off - hash->pos < (off_t)sizeof(zero) ?
+		                off - hash->pos : sizeof(zero));
+}
+
+static void xcp_hash_final(struct xcp_hash *hash, char *out, size_t size)
+{
+	uint64_t bits = hash->pos * 8;
+	unsigned char pad[72] = {0x80};
+	unsigned int i, n;
+
+	if (hash->type == XCP_HASH_CRC32C) {
+		snprintf(out, size, "%08x", ~hash->crc);
+		return;
+	}
+	n = (hash->fill < 56 ? 56 : 120) - hash->fill;
+	for (i = 0; i < 8; ++i)
+		pad[n+i] = bits >> (56 - 8 * i);
+	xcp_hash_update(hash, pad, n + 8);
+	for (i = 0; i < 8 && size > 8 * i + 8; ++i)
+		snprintf(out + 8 * i, size - 8 * i, "%08x", hash->h[i]);
+}
+
+static void xcp_hash_data(struct xcp_job *job, off_t off, const void *p,
+    size_t len)
+{
+	if (job->hash == NULL)
+		return;
+	xcp_hash_seek(job->hash, off);
+	xcp_hash_update(job->hash, p, len);
+}
+
+/**
+ * xcp_hash_fd - hash @fd's first @end bytes by reading them
+ */
+static int xcp_hash_fd(struct xcp_hash *hash, int fd, off_t end)
+{
+	static const size_t bufsize = 1 << 20;
+	off_t off = 0;
+	ssize_t ret;
+	void *buf;
+
+	/* Aligned, so that this also works for O_DIRECT descriptors */
+	if (posix_memalign(&buf, sysconf(_SC_PAGESIZE), bufsize) != 0)
+		return -ENOMEM;
+	while (off < end) {
+		ret = pread(fd, buf, bufsize, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			ret = ret < 0 ? -errno : -EIO;
+			free(buf);
+			return ret;
+		}
+		if (ret > end - off)
+			ret = end - off;
+		xcp_hash_update(hash, buf, ret);
+		off += ret;
+	}
+	free(buf);
+	return 0;
+}
+
+/*
+ *	Instrumentation for --stats and --bench
+ */
+
+/**
+ * @calls:	number of data-moving syscalls
+ * @bytes:	bytes copied
+ * @hist:	I/O request latencies; bucket n counts [2^(n-1), 2^n) µs
+ */
+struct xcp_stats {
+	unsigned long long calls, bytes;
+	unsigned long long hist[24];
+};
+
+static struct xcp_stats xcp_stats;
+
+static unsigned long long xcp_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long xcp_stat_begin(void)
+{
+	return xcp_stats_on ? xcp_clock() : 0;
+}
+
+static void xcp_stat_call(void)
+{
+	if (xcp_stats_on)
+		__atomic_add_fetch(&xcp_stats.calls, 1, __ATOMIC_RELAXED);
+}
+
+static void xcp_stat_io(unsigned long long t0)
+{
+	unsigned long long us;
+	unsigned int b = 0;
+
+	if (!xcp_stats_on)
+		return;
+	for (us = (xcp_clock() - t0) / 1000; us > 0 &&
+	     b < ARRAY_SIZE(xcp_stats.hist) - 1; us >>= 1)
+		++b;
+	__atomic_add_fetch(&xcp_stats.hist[b], 1, __ATOMIC_RELAXED);
+}
+
+/* Evaluate a syscall, counting it and its latency (errno is preserved) */
+#define XCP_TIMED(call) ({ \
+	unsigned long long xcp_t0 = xcp_stat_begin(); \
+	__typeof__(call) xcp_ret = (call); \
+	xcp_stat_call(); \
+	xcp_stat_io(xcp_t0); \
+	xcp_ret; \
+})
+
+static void xcp_stats_print(const char *arg0, unsigned long long ns)
+{
+	unsigned long long max = 0;
+	unsigned int i, j, last = 0;
+	double secs = ns / 1e9;
+
+	fprintf(stderr, "%s: %llu bytes in %.3f s (%.1f MB/s), "
+	        "%llu syscalls\n", arg0, xcp_stats.bytes, secs,
+	        secs > 0 ? xcp_stats.bytes / secs / 1e6 : 0.0,
+	        xcp_stats.calls);
+	for (i = 0; i < ARRAY_SIZE(xcp_stats.hist); ++i) {
+		if (xcp_stats.hist[i] > max)
+			max = xcp_stats.hist[i];
+		if (xcp_stats.hist[i] != 0)
+			last = i;
+	}
+	if (max == 0)
+		return;
+	fprintf(stderr, "%s: I/O request latency:\n", arg0);
+	for (i = 0; i <= last; ++i) {
+		fprintf(stderr, "  %8llu - %8llu us %10llu ",
+		        i == 0 ? 0 : 1ULL << (i - 1), (1ULL << i) - 1,
+		        xcp_stats.hist[i]);
+		for (j = 0; j < xcp_stats.hist[i] * 40 / max; ++j)
+			fputc('#', stderr);
+		fputc('\n', stderr);
+	}
+}
+
+/*
+ *	Bandwidth and request rate limits
+ */
+
+/**
+ * @next_byte:	time (ns) at which the next byte may be moved
+ * @next_op:	time at which the next request may be issued
+ */
+struct xcp_bucket {
+	pthread_mutex_t lock;
+	unsigned long long next_byte, next_op;
+};
+
+static struct xcp_bucket xcp_bucket = {PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * xcp_throttle_chunk - largest piece to move in one request
+ *
+ * Under --bwlimit, I/O is cut into pieces of 10 ms worth of data, which
+ * is thus the largest burst that can happen.
+ */
+static size_t xcp_throttle_chunk(size_t len)
+{
+	unsigned long long max = xcp_bwlimit / 100;
+
+	if (xcp_bwlimit == 0)
+		return len;
+	if (max < 4096)
+		max = 4096;
+	return len < max ? len : max;
+}
+
+/**
+ * xcp_throttle - wait until a request of @len bytes may be issued
+ *
+ * This is a token bucket in its virtual scheduling form: every request
+ * reserves the next len/rate (and 1/iops) seconds of the timeline and
+ * sleeps until its reservation begins. Time spent idle is not credited,
+ * so there is no burst after a pause. The bucket is shared by all threads.
+ */
+static void xcp_throttle(size_t len)
+{
+	unsigned long long now, at;
+	struct timespec ts;
+
+	if (xcp_bwlimit == 0 && xcp_iops_limit == 0)
+		return;
+	now = at = xcp_clock();
+	pthread_mutex_lock(&xcp_bucket.lock);
+	if (xcp_bwlimit != 0) {
+		if (xcp_bucket.next_byte < now)
+			xcp_bucket.next_byte = now;
+		at = xcp_bucket.next_byte;
+		xcp_bucket.next_byte += len * 1000000000ULL / xcp_bwlimit;
+	}
+	if (xcp_iops_limit != 0) {
+		if (xcp_bucket.next_op < now)
+			xcp_bucket.next_op = now;
+		if (xcp_bucket.next_op > at)
+			at = xcp_bucket.next_op;
+		xcp_bucket.next_op += 1000000000ULL / xcp_iops_limit;
+	}
+	pthread_mutex_unlock(&xcp_bucket.lock);
+	if (at <= now)
+		return;
+	ts.tv_sec  = at / 1000000000ULL;
+	ts.tv_nsec = at % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+	       NULL) == EINTR)
+		;
+}
+
+/**
+ * xcp_whole_disk - map a partition's device number to that of its disk
+ */
+static bool xcp_whole_disk(dev_t dev, unsigned int *maj, unsigned int *min)
+{
+	char path[64];
+	FILE *fp;
+	bool ok;
+
+	*maj = major(dev);
+	*min = minor(dev);
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u", *maj, *min);
+	if (access(path, F_OK) < 0)
+		/* tmpfs, NFS, etc. */
+		return false;
+	HX_strlcpy(path + strlen(path), "/partition",
+	           sizeof(path) - strlen(path));
+	if (access(path, F_OK) < 0)
+		return true;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+	         *maj, *min);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return false;
+	ok = fscanf(fp, "%u:%u", maj, min) == 2;
+	fclose(fp);
+	return ok;
+}
+
+/*
+ * io.max is shared by everything in our cgroup, so the lines it had
+ * before are put back when xcp exits, also on a fatal signal. They are
+ * prepared in advance since the signal handler can only write(2) them.
+ */
+static struct {
+	char file[PATH_MAX + 32];
+	char line[16][160];
+	size_t len[16];
+	unsigned int n;
+} xcp_io_saved;
+
+static void xcp_io_max_restore(void)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < xcp_io_saved.n; ++i) {
+		fd = open(xcp_io_saved.file, O_WRONLY);
+		if (fd < 0)
+			break;
+		if (write(fd, xcp_io_saved.line[i], xcp_io_saved.len[i]) < 0) {
+			/* nothing more we can do */
+		}
+		close(fd);
+	}
+	xcp_io_saved.n = 0;
+}
+
+static void xcp_io_max_signal(int sig)
+{
+	xcp_io_max_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/**
+ * xcp_io_max_save - remember the current io.max settings of @maj:@min
+ *
+ * Devices without a line of their own are unlimited, which is what gets
+ * written back for them.
+ */
+static void xcp_io_max_save(const char *file, unsigned int maj,
+    unsigned int min)
+{
+	static const int sigs[] = {SIGHUP, SIGINT, SIGQUIT, SIGPIPE, SIGTERM};
+	unsigned int i = xcp_io_saved.n, j;
+	struct sigaction sa = {.sa_handler = xcp_io_max_signal};
+	char buf[160], key[24];
+	FILE *fp;
+
+	if (i == 0) {
+		HX_strlcpy(xcp_io_saved.file, file, sizeof(xcp_io_saved.file));
+		atexit(xcp_io_max_restore);
+		for (j = 0; j < ARRAY_SIZE(sigs); ++j)
+			sigaction(sigs[j], &sa, NULL);
+	}
+	snprintf(key, sizeof(key), "%u:%u ", maj, min);
+	snprintf(xcp_io_saved.line[i], sizeof(xcp_io_saved.line[i]),
+	         "%u:%u rbps=max wbps=max riops=max wiops=max", maj, min);
+	fp = fopen(file, "r");
+	if (fp != NULL) {
+		while (fgets(buf, sizeof(buf), fp) != NULL)
+			if (strncmp(buf, key, strlen(key)) == 0) {
+				buf[strcspn(buf, "\n")] = '\0';
+				HX_strlcpy(xcp_io_saved.line[i], buf,
+				           sizeof(xcp_io_saved.line[i]));
+				break;
+			}
+		fclose(fp);
+	}
+	xcp_io_saved.len[i] = strlen(xcp_io_saved.line[i]);
+	xcp_io_saved.n = i + 1;
+}
+
+/**
+ * xcp_set_io_max - mirror the limits into the cgroup v2 io.max file
+ * @paths:	files (or their would-be locations) whose devices to limit
+ *
+ * The kernel then also enforces the limits for writeback that happens on
+ * our behalf. Writing io.max needs a delegated cgroup (or root); when
+ * that fails, the line to use is printed instead. The previous settings
+ * are restored on exit.
+ */
+static void xcp_set_io_max(const char *arg0, const char *const *paths,
+    unsigned int n)
+{
+	char cg[PATH_MAX], file[PATH_MAX + 32], line[160];
+	unsigned int i, j, maj, min, done[16][2], ndone = 0;
+	size_t len;
+	struct stat sb;
+	char *dir, *slash;
+	int fd, ret;
+	FILE *fp;
+
+	*cg = '\0';
+	fp = fopen("/proc/self/cgroup", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL)
+			if (strncmp(line, "0::", 3) == 0) {
+				HX_strlcpy(cg, line + 3, sizeof(cg));
+				cg[strcspn(cg, "\n")] = '\0';
+				break;
+			}
+		fclose(fp);
+	}
+	snprintf(file, sizeof(file), "/sys/fs/cgroup%s/io.max",
+	         strcmp(cg, "/") == 0 ? "" : cg);
+
+	for (i = 0; i < n; ++i) {
+		if (stat(paths[i], &sb) < 0) {
+			/* Destination not created yet: use its directory */
+			dir   = HX_strdup(paths[i]);
+			slash = dir != NULL ? strrchr(dir, '/') : NULL;
+			if (slash != NULL)
+				*slash = '\0';
+			ret = stat(slash == NULL ? "." : *dir == '\0' ? "/" :
+			      dir, &sb);
+			free(dir);
+			if (ret < 0)
+				continue;
+		}
+		if (!xcp_whole_disk(sb.st_dev, &maj, &min))
+			continue;
+		for (j = 0; j < ndone; ++j)
+			if (done[j][0] == maj && done[j][1] == min)
+				break;
+		if (j < ndone || ndone == ARRAY_SIZE(done))
+			continue;
+		done[ndone][0] = maj;
+		done[ndone++][1] = min;
+
+		len = snprintf(line, sizeof(line), "%u:%u", maj, min);
+		if (xcp_bwlimit != 0)
+			len += snprintf(line + len, sizeof(line) - len,
+			       " rbps=%llu wbps=%llu", xcp_bwlimit,
+			       xcp_bwlimit);
+		if (xcp_iops_limit != 0)
+			snprintf(line + len, sizeof(line) - len,
+			         " riops=%u wiops=%u", xcp_iops_limit,
+			         xcp_iops_limit);
+		/* Never create the file: no io controller means no io.max */
+		fd = open(file, O_WRONLY);
+		if (fd >= 0)
+			/* Before writing, so that a signal cannot skip it */
+			xcp_io_max_save(file, maj, min);
+		ret = fd >= 0 && write(fd, line, strlen(line)) > 0;
+		if (fd >= 0 && close(fd) < 0)
+			ret = false;
+		if (!ret && fd >= 0)
+			--xcp_io_saved.n;
+		if (!ret)
+			fprintf(stderr, "%s: cannot write %s (%s); to apply "
+			        "the limit there, run as root:\n"
+			        "\techo \"%s\" >%s\n", arg0, file,
+			        strerror(errno), line, file);
+		else if (xcp_verbose)
+			fprintf(stderr, "%s: %s: %s\n", arg0, file, line);
+	}
+}
+
+/**
+ * xcp_unsupported - whether an engine error means "try another engine"
+ *
+ * copy_file_range reports EBADF for an O_APPEND destination
+ * (e.g. "xcp src >>log").
+ */
+static bool xcp_unsupported(int err)
+{
+	return err == -ENOSYS || err == -EOPNOTSUPP || err == -EXDEV ||
+	       err == -EINVAL || err == -ENOTTY || err == -EPERM ||
+	       err == -ENOMEM || err == -EBADF;
+}
+
+static int xcp_reflink(struct xcp_job *job, off_t off, off_t len)
+{
+#ifdef FICLONE
+	job->what = "ioctl(FICLONE)";
+	if (XCP_TIMED(ioctl(job->ofd, FICLONE, job->ifd)) < 0)
+		return errno == EBADF ? -EOPNOTSUPP : -errno;
+	job->copied += len;
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+static int xcp_copy_range(struct xcp_job *job, off_t off, off_t len)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	loff_t ioff = off, ooff = off;
+	ssize_t ret;
+
+	job->what = "copy_file_range";
+	while (len > 0) {
+		size_t piece = xcp_throttle_chunk(len);
+
+		xcp_throttle(piece);
+		ret = XCP_TIMED(copy_file_range(job->ifd, &ioff, job->ofd,
+		      &ooff, piece, 0));
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			/*
+			 * Pseudo-files (procfs etc.) report zero here,
+			 * as does a file that shrank during the copy.
+			 */
+			return job->copied == 0 ? -EOPNOTSUPP : 0;
+		len -= ret;
+		job->copied += ret;
+	}
+	return 0;
+#else
+	return -ENOSYS;
+#endif
+}
+
+/**
+ * @pfd:	intermediate pipe (unused when the destination is a pipe)
+ * @side:	tee(2) target for --hash, or -1
+ * @size:	capacity of the pipe that data is spliced into
+ * @to_pipe:	destination is a pipe and can be spliced into directly
+ * @buf:	buffer for reading @side
+ * @xpipe:	one pipe per extra destination, fed by tee(2) from @pfd
+ */
+struct xcp_splice_state {
+	int pfd[2], side[2], *xpipe;
+	size_t size;
+	bool to_pipe;
+	char *buf;
+};
+
+/**
+ * xcp_pipe_grow - enlarge a pipe as far as the system allows
+ *
+ * Unprivileged users may be limited below pipe-max-size by
+ * pipe-user-pages-soft, so retry with smaller sizes on EPERM.
+ */
+static size_t xcp_pipe_grow(int fd)
+{
+	unsigned long max = 1 << 20;
+	FILE *fp;
+	int ret;
+
+	fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%lu", &max) != 1)
+			max = 1 << 20;
+		fclose(fp);
+	}
+	for (; max >= 65536; max /= 2) {
+		ret = fcntl(fd, F_SETPIPE_SZ, max);
+		if (ret >= 0)
+			return ret;
+		if (errno != EPERM)
+			break;
+	}
+	ret = fcntl(fd, F_GETPIPE_SZ);
+	return ret > 0 ? ret : 65536;
+}
+
+static void xcp_splice_teardown(struct xcp_job *job)
+{
+	struct xcp_splice_state *st = job->priv;
+	unsigned int i;
+
+	if (!st->to_pipe) {
+		close(st->pfd[0]);
+		close(st->pfd[1]);
+	}
+	if (st->side[0] >= 0) {
+		close(st->side[0]);
+		close(st->side[1]);
+	}
+	for (i = 0; st->xpipe != NULL && i < 2 * job->nxfd; ++i)
+		if (st->xpipe[i] >= 0)
+			close(st->xpipe[i]);
+	free(st->xpipe);
+	free(st->buf);
+	free(st);
+}
+
+static int xcp_splice_setup(struct xcp_job *job)
+{
+	struct xcp_splice_state *st;
+	unsigned int i;
+	struct stat sb;
+
+	st = calloc(1, sizeof(*st));
+	if (st == NULL)
+		return -errno;
+	st->side[0] = st->side[1] = -1;
+	/* Hashing and fan-out need the intermediate pipe to tee from */
+	st->to_pipe = job->hash == NULL && job->nxfd == 0 &&
+	              fstat(job->ofd, &sb) == 0 && S_ISFIFO(sb.st_mode);
+	if (st->to_pipe) {
+		st->pfd[0] = st->pfd[1] = -1;
+		st->size   = xcp_pipe_grow(job->ofd);
+	} else if (pipe(st->pfd) < 0) {
+		job->what = "pipe";
+		free(st);
+		return -errno;
+	} else {
+		st->size = xcp_pipe_grow(st->pfd[1]);
+	}
+	job->priv = st;
+	if (job->nxfd > 0) {
+		st->xpipe = malloc(2 * job->nxfd * sizeof(*st->xpipe));
+		if (st->xpipe == NULL) {
+			xcp_splice_teardown(job);
+			return -ENOMEM;
+		}
+		for (i = 0; i < 2 * job->nxfd; ++i)
+			st->xpipe[i] = -1;
+		for (i = 0; i < job->nxfd; ++i) {
+			if (pipe(&st->xpipe[2*i]) < 0) {
+				job->what = "pipe";
+				st->xpipe[2*i] = st->xpipe[2*i+1] = -1;
+				xcp_splice_teardown(job);
+				return -errno;
+			}
+			/* Every tee must be able to take a full pipe */
+			if (xcp_pipe_grow(st->xpipe[2*i+1]) < st->size)
+				st->size = fcntl(st->xpipe[2*i+1],
+				           F_GETPIPE_SZ);
+		}
+	}
+	if (job->hash == NULL)
+		return 0;
+	if (pipe(st->side) < 0) {
+		job->what = "pipe";
+		st->side[0] = st->side[1] = -1;
+		xcp_splice_teardown(job);
+		return -errno;
+	}
+	/* Side pipe must be able to take all that tee offers */
+	if (xcp_pipe_grow(st->side[1]) < st->size)
+		st->size = fcntl(st->side[1], F_GETPIPE_SZ);
+	st->buf = malloc(st->size);
+	if (st->buf == NULL) {
+		xcp_splice_teardown(job);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+/**
+ * xcp_splice_hash - consume @len teed bytes from the side pipe and hash them
+ */
+static int xcp_splice_hash(struct xcp_job *job,
+    const struct xcp_splice_state *st, off_t off, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = XCP_TIMED(read(st->side[0], st->buf + done,
+		      len - done));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			job->what = "read(tee)";
+			return ret < 0 ? -errno : -EIO;
+		}
+		done += ret;
+	}
+	xcp_hash_data(job, off, st->buf, len);
+	return 0;
+}
+
+/**
+ * xcp_splice_fanout - duplicate @len bytes from the main pipe to every
+ * extra destination
+ *
+ * tee(2) copies only page references, so the source is still read once.
+ */
+static int xcp_splice_fanout(struct xcp_job *job,
+    const struct xcp_splice_state *st, off_t off, size_t len,
+    unsigned int flags)
+{
+	loff_t xoff;
+	unsigned int i;
+	ssize_t ret;
+	size_t done;
+
+	for (i = 0; i < job->nxfd; ++i) {
+		ret = XCP_TIMED(tee(st->pfd[0], st->xpipe[2*i+1], len, 0));
+		if (ret < 0) {
+			job->what = "tee";
+			return -errno;
+		}
+		if ((size_t)ret != len) {
+			job->what = "tee";
+			return -EIO;
+		}
+		xoff = off;
+		for (done = 0; done < len; done += ret) {
+			ret = XCP_TIMED(splice(st->xpipe[2*i], NULL,
+			      job->xfd[i], job->stream ? NULL : &xoff,
+			      len - done, flags));
+			if (ret < 0) {
+				job->what = "splice-out";
+				return -errno;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * xcp_splice - move data with splice(2)
+ *
+ * Each round fills the (enlarged) pipe with one call and drains it
+ * completely before refilling. If the destination is a pipe itself, the
+ * intermediate one is skipped. Sockets and pipes are written without an
+ * offset, as they have none. For --hash and extra destinations, the pipe
+ * contents are duplicated with tee(2) into a side pipe each.
+ */
+static int xcp_splice(struct xcp_job *job, off_t off, off_t len)
+{
+	const struct xcp_splice_state *st = job->priv;
+	loff_t ioff = off, ooff = off, *optr = job->stream ? NULL : &ooff;
+	unsigned int flags;
+	ssize_t ret, fill;
+
+	while (len > 0) {
+		fill  = xcp_throttle_chunk(len < (off_t)st->size ?
+		        len : (off_t)st->size);
+		flags = SPLICE_F_MOVE | (fill < len ? SPLICE_F_MORE : 0);
+		xcp_throttle(fill);
+		if (st->to_pipe) {
+			ret = XCP_TIMED(splice(job->ifd, &ioff, job->ofd, NULL,
+			      fill, flags));
+			if (ret < 0) {
+				job->what = "splice";
+				return -errno;
+			}
+			if (ret == 0)
+				break;
+			len -= ret;
+			job->copied += ret;
+			continue;
+		}
+		fill = XCP_TIMED(splice(job->ifd, &ioff, st->pfd[1], NULL,
+		       fill, flags));
+		if (fill < 0) {
+			job->what = "splice-in";
+			return -errno;
+		}
+		if (fill == 0)
+			break;
+		len -= fill;
+		flags = SPLICE_F_MOVE | (len > 0 ? SPLICE_F_MORE : 0);
+		while (fill > 0) {
+			ssize_t part = fill, done;
+
+			if (st->side[1] >= 0) {
+				part = XCP_TIMED(tee(st->pfd[0], st->side[1],
+				       fill, 0));
+				if (part < 0) {
+					job->what = "tee";
+					return -errno;
+				}
+			}
+			if (job->nxfd > 0) {
+				ret = xcp_splice_fanout(job, st, ooff, part,
+				      flags);
+				if (ret < 0)
+					return ret;
+			}
+			/* Move exactly what was teed, and no more */
+			for (done = 0; done < part; done += ret) {
+				ret = XCP_TIMED(splice(st->pfd[0], NULL,
+				      job->ofd, optr, part - done, flags));
+				if (ret < 0) {
+					job->what = "splice-out";
+					return -errno;
+				}
+			}
+			if (st->side[0] >= 0) {
+				ret = xcp_splice_hash(job, st, ioff - fill, part);
+				if (ret < 0)
+					return ret;
+			}
+			fill -= part;
+			job->copied += part;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @data:	aligned buffer
+ * @off:	file offset of the data
+ * @len:	bytes held
+ */
+struct xcp_dio_buf {
+	char *data;
+	off_t off;
+	size_t len;
+};
+
+/**
+ * State for the O_DIRECT engine. Buffers form a ring: the reader fills
+ * buf[tail % nr] and advances @tail, the writer thread drains
+ * buf[head % nr] and advances @head, so one read and one write are in
+ * flight at the same time whenever the ring is neither full nor empty.
+ *
+ * @align:	alignment for buffers, offsets and lengths
+ * @chunk:	size of each buffer
+ * @iflags, @oflags:	original file status flags, restored on teardown
+ * @error:	first error seen by the writer
+ */
+struct xcp_dio {
+	struct xcp_job *job;
+	struct xcp_dio_buf *buf;
+	char *pool;
+	size_t align, chunk;
+	unsigned int nr, head, tail;
+	int iflags, oflags, error;
+	bool quit;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * xcp_dio_pwrite - write out a buffer, doing any unaligned rest buffered
+ */
+static int xcp_dio_pwrite(struct xcp_dio *d, const char *p, size_t len,
+    off_t off)
+{
+	int fd = d->job->ofd;
+	size_t direct = len & ~(d->align - 1);
+	ssize_t ret;
+
+	while (len > 0) {
+		if (direct == 0 && fcntl(fd, F_SETFL, d->oflags) < 0)
+			return -errno;
+		ret = XCP_TIMED(pwrite(fd, p, direct != 0 ? direct : len,
+		      off));
+		if (direct == 0)
+			fcntl(fd, F_SETFL, d->oflags | O_DIRECT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p   += ret;
+		off += ret;
+		len -= ret;
+		direct = direct > (size_t)ret ? direct - ret : 0;
+		direct &= ~(d->align - 1);
+	}
+	return 0;
+}
+
+static void *xcp_dio_writer(void *arg)
+{
+	struct xcp_dio *d = arg;
+	struct xcp_dio_buf *b;
+	int ret;
+
+	pthread_mutex_lock(&d->lock);
+	while (true) {
+		while (d->head == d->tail && !d->quit)
+			pthread_cond_wait(&d->cond, &d->lock);
+		if (d->head == d->tail)
+			break;
+		b = &d->buf[d->head % d->nr];
+		pthread_mutex_unlock(&d->lock);
+		/* After an error, just discard so the reader does not block */
+		ret = d->error == 0 ? xcp_dio_pwrite(d, b->data, b->len,
+		      b->off) : 0;
+		pthread_mutex_lock(&d->lock);
+		if (ret < 0 && d->error == 0) {
+			d->job->what = "write";
+			d->error = ret;
+		} else if (d->error == 0) {
+			xcp_hash_data(d->job, b->off, b->data, b->len);
+			d->job->copied += b->len;
+		}
+		++d->head;
+		pthread_cond_broadcast(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+/**
+ * xcp_dio_drain - wait until the writer has caught up
+ */
+static int xcp_dio_drain(struct xcp_dio *d)
+{
+	int ret;
+
+	pthread_mutex_lock(&d->lock);
+	while (d->head != d->tail)
+		pthread_cond_wait(&d->cond, &d->lock);
+	ret = d->error;
+	pthread_mutex_unlock(&d->lock);
+	return ret;
+}
+
+/**
+ * xcp_dio_bounce - copy an unaligned piece through the page cache
+ *
+ * Must only be called while the writer is idle. Short writes are simply
+ * retried through the loop.
+ */
+static int xcp_dio_bounce(struct xcp_dio *d, off_t off, off_t end)
+{
+	struct xcp_job *job = d->job;
+	char *buf = d->buf[0].data;
+	ssize_t ret = 0;
+	size_t n;
+
+	if (off >= end)
+		return 0;
+	/* The writer is idle, so the first ring buffer is free */
+	if (fcntl(job->ifd, F_SETFL, d->iflags) < 0 ||
+	    fcntl(job->ofd, F_SETFL, d->oflags) < 0) {
+		job->what = "fcntl";
+		return -errno;
+	}
+	while (off < end) {
+		n = end - off < (off_t)d->chunk ? end - off : d->chunk;
+		ret = XCP_TIMED(pread(job->ifd, buf, n, off));
+		if (ret <= 0) {
+			job->what = "read";
+			ret = ret < 0 ? -errno : 0;
+			break;
+		}
+		xcp_hash_data(job, off, buf, ret);
+		for (n = ret; n > 0; n -= ret) {
+			ret = XCP_TIMED(pwrite(job->ofd, buf, n, off));
+			if (ret < 0)
+				break;
+			buf += ret;
+			off += ret;
+			job->copied += ret;
+		}
+		buf = d->buf[0].data;
+		if (ret < 0) {
+			job->what = "write";
+			ret = -errno;
+			break;
+		}
+	}
+	fcntl(job->ifd, F_SETFL, d->iflags | O_DIRECT);
+	fcntl(job->ofd, F_SETFL, d->oflags | O_DIRECT);
+	return ret < 0 ? ret : 0;
+}
+
+static void xcp_direct_teardown(struct xcp_job *job)
+{
+	struct xcp_dio *d = job->priv;
+
+	pthread_mutex_lock(&d->lock);
+	d->quit = true;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+	pthread_join(d->writer, NULL);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	fcntl(job->ifd, F_SETFL, d->iflags);
+	fcntl(job->ofd, F_SETFL, d->oflags);
+	free(d->pool);
+	free(d->buf);
+	free(d);
+}
+
+/**
+ * xcp_direct_setup - switch both descriptors to O_DIRECT
+ *
+ * Filesystems that do not support O_DIRECT reject it here with -EINVAL,
+ * so the caller can fall back.
+ */
+static int xcp_direct_setup(struct xcp_job *job)
+{
+	struct xcp_dio *d;
+	unsigned int i;
+	int ret;
+
+	if (job->stream)
+		return -EINVAL;
+	d = calloc(1, sizeof(*d));
+	if (d == NULL)
+		return -errno;
+	d->job    = job;
+	d->align  = sysconf(_SC_PAGESIZE);
+	d->chunk  = (xcp_chunk + d->align - 1) & ~(d->align - 1);
+	d->nr     = xcp_depth < 2 ? 2 : xcp_depth;
+	d->iflags = fcntl(job->ifd, F_GETFL);
+	d->oflags = fcntl(job->ofd, F_GETFL);
+	job->what = "fcntl(O_DIRECT)";
+	if (fcntl(job->ifd, F_SETFL, d->iflags | O_DIRECT) < 0 ||
+	    fcntl(job->ofd, F_SETFL, d->oflags | O_DIRECT) < 0) {
+		ret = -errno;
+		fcntl(job->ifd, F_SETFL, d->iflags);
+		free(d);
+		return ret;
+	}
+	d->buf = calloc(d->nr, sizeof(*d->buf));
+	ret = posix_memalign((void **)&d->pool, d->align, d->nr * d->chunk);
+	if (d->buf == NULL || ret != 0) {
+		fcntl(job->ifd, F_SETFL, d->iflags);
+		fcntl(job->ofd, F_SETFL, d->oflags);
+		free(d->buf);
+		free(d);
+		return -ENOMEM;
+	}
+	for (i = 0; i < d->nr; ++i)
+		d->buf[i].data = d->pool + i * d->chunk;
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	job->priv = d;
+	ret = pthread_create(&d->writer, NULL, xcp_dio_writer, d);
+	if (ret != 0) {
+		pthread_cond_destroy(&d->cond);
+		pthread_mutex_destroy(&d->lock);
+		fcntl(job->ifd, F_SETFL, d->iflags);
+		fcntl(job->ofd, F_SETFL, d->oflags);
+		free(d->pool);
+		free(d->buf);
+		free(d);
+		return -ret;
+	}
+	return 0;
+}
+
+/**
+ * xcp_direct - copy with O_DIRECT on both ends
+ *
+ * The aligned middle of the range goes through the buffer ring; the
+ * unaligned head and tail (if any) are bounced through the page cache.
+ */
+static int xcp_direct(struct xcp_job *job, off_t off, off_t len)
+{
+	struct xcp_dio *d = job->priv;
+	off_t end = off + len, pos, a_end;
+	struct xcp_dio_buf *b;
+	ssize_t ret;
+	size_t n;
+
+	pos   = (off + d->align - 1) & ~(off_t)(d->align - 1);
+	a_end = end & ~(off_t)(d->align - 1);
+	if (pos >= a_end)
+		return xcp_dio_bounce(d, off, end);
+	ret = xcp_dio_bounce(d, off, pos);
+	if (ret < 0)
+		return ret;
+
+	while (pos < a_end) {
+		pthread_mutex_lock(&d->lock);
+		while (d->tail - d->head == d->nr && d->error == 0)
+			pthread_cond_wait(&d->cond, &d->lock);
+		ret = d->error;
+		b   = &d->buf[d->tail % d->nr];
+		pthread_mutex_unlock(&d->lock);
+		if (ret < 0)
+			break;
+
+		n   = a_end - pos < (off_t)d->chunk ? a_end - pos : d->chunk;
+		ret = XCP_TIMED(pread(job->ifd, b->data, n, pos));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			ret = -errno;
+			xcp_dio_drain(d);
+			job->what = "read";
+			return ret;
+		}
+		if (ret == 0)
+			/* File shrank */
+			break;
+		b->off = pos;
+		b->len = ret;
+		pthread_mutex_lock(&d->lock);
+		++d->tail;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		pos += ret;
+		if ((size_t)ret < n)
+			break;
+	}
+	ret = xcp_dio_drain(d);
+	if (ret < 0)
+		return ret;
+	return pos == a_end ? xcp_dio_bounce(d, a_end, end) : 0;
+}
+
+/**
+ * @off:	file offset of the mapping (page-aligned)
+ * @len:	length of the mapping
+ * @area:	the mapping
+ */
+struct xcp_window {
+	off_t off;
+	size_t len;
+	char *area;
+};
+
+static int xcp_window_map(struct xcp_job *job, struct xcp_window *w,
+    off_t off, off_t end)
+{
+	w->off = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	w->len = xcp_window;
+	if ((off_t)w->len > end - w->off)
+		w->len = end - w->off;
+	w->area = mmap(NULL, w->len, PROT_READ, MAP_SHARED, job->ifd, w->off);
+	if (w->area == MAP_FAILED) {
+		job->what = "mmap";
+		return -errno;
+	}
+	madvise(w->area, w->len, MADV_SEQUENTIAL);
+	return 0;
+}
+
+/**
+ * xcp_window_drop - release a window and its page cache
+ */
+static void xcp_window_drop(struct xcp_job *job, struct xcp_window *w)
+{
+	madvise(w->area, w->len, MADV_DONTNEED);
+	munmap(w->area, w->len);
+	posix_fadvise(job->ifd, w->off, w->len, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * @set:	set this destination belongs to
+ * @fd:		destination
+ * @tid:	writer thread for this destination
+ * @thread:	@tid is valid and needs to be joined
+ * @err:	0 or negative errno from the last piece
+ */
+struct xcp_fanout {
+	struct xcp_fanout_set *set;
+	int fd;
+	pthread_t tid;
+	bool thread;
+	int err;
+};
+
+/**
+ * @fan:	one entry per destination, [0] being @job->ofd
+ * @nr:		number of entries in @fan
+ * @p:		piece currently being written
+ * @len:	length of @p
+ * @off:	destination offset (ignored for streams)
+ * @stream:	use write(2) instead of pwrite(2)
+ * @gen:	bumped for every new piece handed to the writers
+ * @busy:	writer threads still working on the current piece
+ * @quit:	writers are to exit
+ */
+struct xcp_fanout_set {
+	struct xcp_fanout *fan;
+	unsigned int nr;
+	const char *p;
+	size_t len;
+	off_t off;
+	bool stream, quit;
+	unsigned long gen;
+	unsigned int busy;
+	pthread_mutex_t lock;
+	pthread_cond_t go, done;
+};
+
+static int xcp_fanout_put(const struct xcp_fanout_set *set, int fd)
+{
+	const char *p = set->p;
+	size_t len = set->len;
+	off_t off = set->off;
+	ssize_t ret;
+
+	while (len > 0) {
+		if (set->stream)
+			ret = XCP_TIMED(write(fd, p, len));
+		else
+			ret = XCP_TIMED(pwrite(fd, p, len, off));
+		if (ret < 0)
+			return -errno;
+		p   += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * xcp_fanout_main - writer thread for one extra destination
+ *
+ * Lives for the whole job and writes every piece published by
+ * xcp_mmap_write. The piece stays unchanged until @busy dropped to zero.
+ */
+static void *xcp_fanout_main(void *arg)
+{
+	struct xcp_fanout *f = arg;
+	struct xcp_fanout_set *set = f->set;
+	unsigned long seen = 0;
+	int err;
+
+	pthread_mutex_lock(&set->lock);
+	while (true) {
+		while (set->gen == seen && !set->quit)
+			pthread_cond_wait(&set->go, &set->lock);
+		if (set->quit)
+			break;
+		seen = set->gen;
+		pthread_mutex_unlock(&set->lock);
+		err = xcp_fanout_put(set, f->fd);
+		pthread_mutex_lock(&set->lock);
+		f->err = err;
+		if (--set->busy == 0)
+			pthread_cond_signal(&set->done);
+	}
+	pthread_mutex_unlock(&set->lock);
+	return NULL;
+}
+
+static void xcp_mmap_teardown(struct xcp_job *job)
+{
+	struct xcp_fanout_set *set = job->priv;
+	unsigned int i;
+
+	if (set == NULL)
+		return;
+	pthread_mutex_lock(&set->lock);
+	set->quit = true;
+	pthread_cond_broadcast(&set->go);
+	pthread_mutex_unlock(&set->lock);
+	for (i = 0; i < set->nr; ++i)
+		if (set->fan[i].thread)
+			pthread_join(set->fan[i].tid, NULL);
+	pthread_cond_destroy(&set->done);
+	pthread_cond_destroy(&set->go);
+	pthread_mutex_destroy(&set->lock);
+	free(set->fan);
+	free(set);
+	job->priv = NULL;
+}
+
+/**
+ * xcp_mmap_setup - start one writer thread per extra destination
+ *
+ * The threads are created once per job rather than per piece. A
+ * destination whose thread could not be started is written inline.
+ */
+static int xcp_mmap_setup(struct xcp_job *job)
+{
+	struct xcp_fanout_set *set;
+	unsigned int i;
+
+	if (job->nxfd == 0)
+		return 0;
+	set = calloc(1, sizeof(*set));
+	if (set == NULL)
+		return -errno;
+	set->nr     = job->nxfd + 1;
+	set->stream = job->stream;
+	set->fan    = calloc(set->nr, sizeof(*set->fan));
+	if (set->fan == NULL) {
+		free(set);
+		return -ENOMEM;
+	}
+	pthread_mutex_init(&set->lock, NULL);
+	pthread_cond_init(&set->go, NULL);
+	pthread_cond_init(&set->done, NULL);
+	for (i = 0; i < set->nr; ++i) {
+		set->fan[i].set = set;
+		set->fan[i].fd  = i == 0 ? job->ofd : job->xfd[i-1];
+	}
+	for (i = 1; i < set->nr; ++i)
+		set->fan[i].thread = pthread_create(&set->fan[i].tid, NULL,
+		                     xcp_fanout_main, &set->fan[i]) == 0;
+	job->priv = set;
+	return 0;
+}
+
+/**
+ * xcp_mmap_write - write one mapped window to all destinations
+ *
+ * Extra destinations are written concurrently by their writer threads from
+ * the same pages, which were read only once; @job->ofd (and any destination
+ * lacking a thread) is written by the caller meanwhile.
+ */
+static int xcp_mmap_write(struct xcp_job *job, const char *p, size_t len,
+    off_t off)
+{
+	struct xcp_fanout_set *set = job->priv;
+	struct xcp_fanout *f;
+	unsigned int i;
+	int ret = 0;
+
+	if (set == NULL) {
+		struct xcp_fanout_set one = {.p = p, .len = len, .off = off,
+		                             .stream = job->stream};
+
+		ret = xcp_fanout_put(&one, job->ofd);
+		if (ret == 0)
+			job->copied += len;
+		return ret;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	set->p    = p;
+	set->len  = len;
+	set->off  = off;
+	set->busy = 0;
+	for (i = 0; i < set->nr; ++i)
+		if (set->fan[i].thread)
+			++set->busy;
+	++set->gen;
+	pthread_cond_broadcast(&set->go);
+	pthread_mutex_unlock(&set->lock);
+
+	for (i = 0; i < set->nr; ++i) {
+		f = &set->fan[i];
+		if (!f->thread)
+			f->err = xcp_fanout_put(set, f->fd);
+	}
+
+	pthread_mutex_lock(&set->lock);
+	while (set->busy > 0)
+		pthread_cond_wait(&set->done, &set->lock);
+	pthread_mutex_unlock(&set->lock);
+	for (i = 0; i < set->nr && ret == 0; ++i)
+		ret = set->fan[i].err;
+	if (ret == 0)
+		job->copied += len;
+	return ret;
+}
+
+/**
+ * xcp_mmap_flush - start writeback of a window, and finish the previous one
+ */
+static void xcp_mmap_flush(int fd, const struct xcp_window *cur,
+    off_t prev_off, off_t prev_len)
+{
+	/* Errors are irrelevant here (e.g. destination is a pipe) */
+	sync_file_range(fd, cur->off, cur->len, SYNC_FILE_RANGE_WRITE);
+	if (prev_off < 0)
+		return;
+	sync_file_range(fd, prev_off, prev_len, SYNC_FILE_RANGE_WAIT_BEFORE |
+	                SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(fd, prev_off, prev_len, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * xcp_mmap - copy through a sliding window of xcp_window bytes
+ *
+ * The next window is mapped and its readahead started (MADV_WILLNEED) before
+ * the current one is written out. Written windows are dropped from the page
+ * cache on both ends (the destination after its writeback completed, one
+ * window later), so memory use stays bounded regardless of file size.
+ * Each window is written to all destinations before it is dropped.
+ */
+static int xcp_mmap(struct xcp_job *job, off_t off, off_t len)
+{
+	struct xcp_window cur, next;
+	off_t end = off + len, prev_off = -1, prev_len = 0;
+	unsigned int i;
+	bool more;
+	ssize_t ret;
+
+	ret = xcp_window_map(job, &cur, off, end);
+	if (ret < 0)
+		return ret;
+	while (true) {
+		const char *p = cur.area + (off - cur.off);
+		size_t todo = cur.off + cur.len - off, piece;
+
+		more = cur.off + (off_t)cur.len < end;
+		if (more) {
+			ret = xcp_window_map(job, &next, cur.off + cur.len, end);
+			if (ret < 0) {
+				xcp_window_drop(job, &cur);
+				return ret;
+			}
+			madvise(next.area, next.len, MADV_WILLNEED);
+		}
+
+		xcp_hash_data(job, off, p, todo);
+		for (ret = 0; ret == 0 && todo > 0; todo -= piece) {
+			piece = xcp_throttle_chunk(todo);
+			xcp_throttle(piece);
+			ret = xcp_mmap_write(job, p, piece, off);
+			p   += piece;
+			off += piece;
+		}
+		xcp_window_drop(job, &cur);
+		if (ret < 0) {
+			job->what = "write";
+			if (more)
+				xcp_window_drop(job, &next);
+			return ret;
+		}
+
+		xcp_mmap_flush(job->ofd, &cur, prev_off, prev_len);
+		for (i = 0; i < job->nxfd; ++i)
+			xcp_mmap_flush(job->xfd[i], &cur, prev_off, prev_len);
+		prev_off = cur.off;
+		prev_len = cur.len;
+		if (!more)
+			break;
+		cur = next;
+	}
+	return 0;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/**
+ * @fd:		ring descriptor
+ * @sq_*, @cq_*:	pointers into the shared submission/completion rings
+ * @sqes:	submission queue entries
+ * @pending:	SQEs queued but not yet passed to io_uring_enter
+ */
+struct xcp_ring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	unsigned int pending;
+};
+
+/**
+ * @off:	file offset the buffer currently corresponds to
+ * @len:	bytes left in this slot's range
+ * @fill:	bytes held in the buffer (valid after a read completed)
+ * @done:	bytes of @fill already written out
+ * @reading:	whether the outstanding request is a read or a write
+ * @t0:		submission time of the outstanding request (--stats)
+ */
+struct xcp_slot {
+	off_t off;
+	size_t len, fill, done;
+	bool reading;
+	unsigned long long t0;
+};
+
+/**
+ * @ring:	the io_uring instance
+ * @slots:	per-buffer state
+ * @iov:	registered buffers, one per slot
+ * @pool:	backing memory for @iov
+ */
+struct xcp_uring_state {
+	struct xcp_ring ring;
+	struct xcp_slot *slots;
+	struct iovec *iov;
+	char *pool;
+};
+
+static void xcp_ring_exit(struct xcp_ring *r)
+{
+	if (r->sqes != NULL && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != NULL && r->cq_map != MAP_FAILED &&
+	    r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_len);
+	if (r->sq_map != NULL && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_len);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+
+static int xcp_ring_init(struct xcp_ring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	int saved_errno;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	r->sq_len   = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_len   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+	r->sq_map = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+	            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto out;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else
+		r->cq_map = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+		            MAP_SHARED | MAP_POPULATE, r->fd,
+		            IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED)
+		goto out;
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+	          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto out;
+
+	r->sq_head  = r->sq_map + p.sq_off.head;
+	r->sq_tail  = r->sq_map + p.sq_off.tail;
+	r->sq_mask  = r->sq_map + p.sq_off.ring_mask;
+	r->sq_array = r->sq_map + p.sq_off.array;
+	r->cq_head  = r->cq_map + p.cq_off.head;
+	r->cq_tail  = r->cq_map + p.cq_off.tail;
+	r->cq_mask  = r->cq_map + p.cq_off.ring_mask;
+	r->cqes     = r->cq_map + p.cq_off.cqes;
+	return 0;
+ out:
+	saved_errno = errno;
+	xcp_ring_exit(r);
+	return -saved_errno;
+}
+
+static void xcp_ring_queue(struct xcp_ring *r, unsigned int op,
+    unsigned int slot, void *buf, size_t len, off_t off, unsigned int file)
+{
+	unsigned int tail = *r->sq_tail, idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = op;
+	sqe->flags     = IOSQE_FIXED_FILE;
+	sqe->fd        = file;
+	sqe->addr      = (unsigned long)buf;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->buf_index = slot;
+	sqe->user_data = slot;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->pending;
+}
+
+/**
+ * xcp_ring_wait - submit queued SQEs and reap one completion
+ */
+static int xcp_ring_wait(struct xcp_ring *r, unsigned int *slot, int *res)
+{
+	unsigned int head;
+	int ret;
+
+	while (true) {
+		head = *r->cq_head;
+		if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+			break;
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, 1,
+		      IORING_ENTER_GETEVENTS, NULL, 0);
+		xcp_stat_call();
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		r->pending -= ret;
+	}
+	*slot = r->cqes[head & *r->cq_mask].user_data;
+	*res  = r->cqes[head & *r->cq_mask].res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void xcp_uring_teardown(struct xcp_job *job)
+{
+	struct xcp_uring_state *u = job->priv;
+
+	xcp_ring_exit(&u->ring);
+	if (u->pool != MAP_FAILED)
+		munmap(u->pool, xcp_depth * xcp_chunk);
+	free(u->iov);
+	free(u->slots);
+	free(u);
+}
+
+/**
+ * xcp_uring_setup - create the ring and register files and buffers
+ *
+ * Fails with -ENOSYS & co. if io_uring cannot be used, so that the caller
+ * may fall back to another engine.
+ */
+static int xcp_uring_setup(struct xcp_job *job)
+{
+	struct xcp_uring_state *u;
+	int fds[2] = {job->ifd, job->ofd}, ret;
+	unsigned int i;
+
+	if (job->stream)
+		return -EINVAL;
+	job->what = "io_uring_setup";
+	u = calloc(1, sizeof(*u));
+	if (u == NULL)
+		return -errno;
+	u->pool = MAP_FAILED;
+	job->priv = u;
+	ret = xcp_ring_init(&u->ring, 2 * xcp_depth);
+	if (ret < 0) {
+		free(u);
+		return ret;
+	}
+	if (syscall(__NR_io_uring_register, u->ring.fd,
+	    IORING_REGISTER_FILES, fds, 2) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	u->slots = calloc(xcp_depth, sizeof(*u->slots));
+	u->iov   = calloc(xcp_depth, sizeof(*u->iov));
+	u->pool  = mmap(NULL, xcp_depth * xcp_chunk, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->slots == NULL || u->iov == NULL || u->pool == MAP_FAILED) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < xcp_depth; ++i) {
+		u->iov[i].iov_base = u->pool + i * xcp_chunk;
+		u->iov[i].iov_len  = xcp_chunk;
+	}
+	if (syscall(__NR_io_uring_register, u->ring.fd,
+	    IORING_REGISTER_BUFFERS, u->iov, xcp_depth) < 0) {
+		ret = -errno;
+		goto out;
+	}
+	return 0;
+ out:
+	xcp_uring_teardown(job);
+	return ret;
+}
+
+/**
+ * xcp_uring - copy using a queue of fixed-buffer reads and writes
+ *
+ * Each of the @xcp_depth slots owns one registered buffer and cycles through
+ * read -> write (-> write remainder) -> next chunk, so that up to
+ * @xcp_depth requests are outstanding against the devices at any time.
+ */
+static int xcp_uring(struct xcp_job *job, off_t off, off_t len)
+{
+	struct xcp_uring_state *u = job->priv;
+	struct xcp_ring *ring = &u->ring;
+	struct iovec *iov = u->iov;
+	unsigned int i, active = 0, idx = 0;
+	off_t next = off, end = off + len;
+	int ret, res = 0;
+
+	for (i = 0; i < xcp_depth && next < end; ++i) {
+		u->slots[i].off = next;
+		u->slots[i].len = xcp_chunk;
+		if (u->slots[i].len > end - next)
+			u->slots[i].len = end - next;
+		u->slots[i].reading = true;
+		u->slots[i].t0 = xcp_stat_begin();
+		next += u->slots[i].len;
+		xcp_ring_queue(ring, IORING_OP_READ_FIXED, i, iov[i].iov_base,
+		               u->slots[i].len, u->slots[i].off, 0);
+		++active;
+	}
+
+	while (active > 0) {
+		struct xcp_slot *s;
+
+		ret = xcp_ring_wait(ring, &idx, &res);
+		if (ret < 0) {
+			job->what = "io_uring_enter";
+			return ret;
+		}
+		s = &u->slots[idx];
+		/* Every path below either resubmits for @s or retires it */
+		xcp_stat_io(s->t0);
+		s->t0 = xcp_stat_begin();
+		if (res < 0) {
+			if (res == -EINTR || res == -EAGAIN) {
+				/* Resubmit the identical request. */
+				if (s->reading)
+					xcp_ring_queue(ring, IORING_OP_READ_FIXED,
+						idx, iov[idx].iov_base, s->len,
+						s->off, 0);
+				else
+					xcp_ring_queue(ring, IORING_OP_WRITE_FIXED,
+						idx, iov[idx].iov_base + s->done,
+						s->fill - s->done,
+						s->off + s->done, 1);
+				continue;
+			}
+			/* Let the kernel finish the rest before bailing */
+			job->what = s->reading ? "read" : "write";
+			while (--active > 0 && xcp_ring_wait(ring, &idx, &ret) == 0)
+				;
+			return res;
+		}
+		if (s->reading) {
+			if (res == 0) {
+				/* File shrank underneath us */
+				--active;
+				continue;
+			}
+			s->reading = false;
+			s->fill    = res;
+			s->done    = 0;
+		} else {
+			s->done += res;
+			job->copied += res;
+		}
+		if (s->done < s->fill) {
+			xcp_ring_queue(ring, IORING_OP_WRITE_FIXED, idx,
+				iov[idx].iov_base + s->done, s->fill - s->done,
+				s->off + s->done, 1);
+			continue;
+		}
+		/* Buffer flushed; continue with rest of range or a new one */
+		s->off += s->fill;
+		s->len -= s->fill;
+		if (s->len == 0) {
+			if (next >= end) {
+				--active;
+				continue;
+			}
+			s->off = next;
+			s->len = xcp_chunk;
+			if (s->len > end - next)
+				s->len = end - next;
+			next += s->len;
+		}
+		s->reading = true;
+		xcp_ring_queue(ring, IORING_OP_READ_FIXED, idx,
+		               iov[idx].iov_base, s->len, s->off, 0);
+	}
+	return 0;
+}
+#else
+static int xcp_uring_setup(struct xcp_job *job)
+{
+	return -ENOSYS;
+}
 
-static bool xcp_get_options(int *argc, const char ***argv)
+static int xcp_uring(struct xcp_job *job, off_t off, off_t len)
 {
-	static struct HXoption options_table[] = {
-		{.sh = 'm', .ln = "mmap", .ptr = &xcp_mode,
-		 .type = HXTYPE_VAL, .val = XCP_MMAP,
-		 .help = "Use mmap(2) for copying"},
-		{.sh = 's', .ln = "splice", .ptr = &xcp_mode,
-		 .type = HXTYPE_VAL, .val = XCP_SPLICE,
-		 .help = "Use splice(2) for copying"},
-		HXOPT_AUTOHELP,
-		HXOPT_TABLEEND,
-	};
-	return HX_getopt(options_table, argc, argv, HXOPT_USAGEONERR) ==
-	       HXOPT_ERR_SUCCESS;
+	return -ENOSYS;
 }
 
-static int xcp_splice(const char *input, const char *output)
+static void xcp_uring_teardown(struct xcp_job *job)
 {
-	off_t ioff = 0, ooff = 0;
-	int ifd, pfd[2], ofd;
-	struct stat isb;
-	long ret;
+}
+#endif /* HAVE_LINUX_IO_URING_H */
 
-	ifd = open(input, O_RDONLY);
-	if (ifd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
-		return EXIT_FAILURE;
+static const struct xcp_engine xcp_engines[] = {
+	[XCP_MMAP]       = {.name = "mmap", .setup = xcp_mmap_setup,
+	                    .copy = xcp_mmap,
+	                    .teardown = xcp_mmap_teardown, .hashes = true,
+	                    .fanout = true, .throttles = true},
+	[XCP_SPLICE]     = {.name = "splice", .setup = xcp_splice_setup,
+	                    .copy = xcp_splice,
+	                    .teardown = xcp_splice_teardown, .hashes = true,
+	                    .fanout = true, .throttles = true},
+	[XCP_URING]      = {.name = "io_uring", .setup = xcp_uring_setup,
+	                    .copy = xcp_uring,
+	                    .teardown = xcp_uring_teardown},
+	/* Reflinking moves no data, so there is nothing to throttle */
+	[XCP_REFLINK]    = {.name = "reflink", .copy = xcp_reflink,
+	                    .whole = true, .throttles = true},
+	[XCP_COPY_RANGE] = {.name = "copy_file_range",
+	                    .copy = xcp_copy_range, .throttles = true},
+	[XCP_DIRECT]     = {.name = "O_DIRECT", .setup = xcp_direct_setup,
+	                    .copy = xcp_direct,
+	                    .teardown = xcp_direct_teardown, .hashes = true},
+};
+
+/* Order in which --auto tries the engines */
+static const unsigned int xcp_auto_order[] = {
+	XCP_REFLINK, XCP_COPY_RANGE, XCP_SPLICE, XCP_MMAP,
+};
+
+/**
+ * xcp_journal_open - set up the --resume sidecar journal
+ *
+ * The journal (@dst.xcp-journal) starts with a line identifying the source
+ * (size and mtime), followed by one "start end" line per range that has
+ * been fdatasync'ed to the destination. If it matches the source and the
+ * destination is at least as long as the last durable offset, the copy
+ * continues from there; otherwise, it starts over.
+ */
+static int xcp_journal_open(struct xcp_job *job, const char *dst,
+    const struct stat *isb, const struct stat *osb)
+{
+	long long size, sec, nsec, start, end, durable = 0;
+	char *path;
+	FILE *fp;
+	int ret;
+
+	if (asprintf(&path, "%s.xcp-journal", dst) < 0) {
+		job->what = "asprintf";
+		return -ENOMEM;
+	}
+	fp = fopen(path, "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "xcp-journal %lld %lld %lld\n",
+		    &size, &sec, &nsec) == 3 && size == isb->st_size &&
+		    sec == isb->st_mtim.tv_sec && nsec == isb->st_mtim.tv_nsec)
+			while (fscanf(fp, "%lld %lld\n", &start, &end) == 2)
+				if (end > durable)
+					durable = end;
+		fclose(fp);
 	}
+	if (durable > osb->st_size) {
+		fprintf(stderr, "%s: shorter than journal claims, "
+		        "starting over\n", dst);
+		durable = 0;
+	}
+	/* Anything past the durable offset is suspect */
+	if (ftruncate(job->ofd, durable) < 0) {
+		ret = -errno;
+		job->what = "ftruncate";
+		free(path);
+		return ret;
+	}
+	if (durable > 0 && xcp_verbose)
+		fprintf(stderr, "%s: resuming at offset %lld\n", dst, durable);
 
-	ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (ofd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
-		return EXIT_FAILURE;
+	job->jfd = open(path, O_WRONLY | O_CREAT | O_APPEND |
+	           (durable == 0 ? O_TRUNC : 0), S_IRUSR | S_IWUSR);
+	if (job->jfd < 0) {
+		ret = -errno;
+		job->what = "open journal";
+		free(path);
+		return ret;
+	}
+	if (durable == 0 && dprintf(job->jfd, "xcp-journal %lld %lld %ld\n",
+	    static_cast(long long, isb->st_size),
+	    static_cast(long long, isb->st_mtim.tv_sec),
+	    isb->st_mtim.tv_nsec) < 0) {
+		ret = -errno;
+		job->what = "journal";
+		close(job->jfd);
+		job->jfd = -1;
+		free(path);
+		return ret;
 	}
+	job->jpath = path;
+	job->start = durable;
+	return 0;
+}
 
-	if (pipe(pfd) < 0) {
-		perror("pfd");
-		return EXIT_FAILURE;
+/**
+ * xcp_checkpoint - make [start,end) durable and record it in the journal
+ */
+static int xcp_checkpoint(struct xcp_job *job, off_t start, off_t end)
+{
+	if (fdatasync(job->ofd) < 0) {
+		job->what = "fdatasync";
+		return -errno;
 	}
+	if (dprintf(job->jfd, "%lld %lld\n", static_cast(long long, start),
+	    static_cast(long long, end)) < 0 || fdatasync(job->jfd) < 0) {
+		job->what = "journal";
+		return -errno;
+	}
+	return 0;
+}
 
-	if (fstat(ifd, &isb) < 0) {
-		perror("fstat");
-		return EXIT_FAILURE;
+/**
+ * xcp_walk - hand the source's data extents to an engine
+ *
+ * Uses SEEK_DATA/SEEK_HOLE to skip holes, which are recreated in the
+ * destination by the final ftruncate. Filesystems without SEEK_DATA support
+ * are treated as having no holes. With a journal, extents are cut into
+ * xcp_ckpt_size pieces, each of which is checkpointed once copied.
+ */
+static int xcp_walk(const struct xcp_engine *e, struct xcp_job *job)
+{
+	off_t data = job->start, hole;
+	bool sparse = job->sparse && !e->whole;
+	unsigned int i;
+	int ret;
+
+	if (e->whole)
+		data = 0;
+	if (job->hash != NULL && data > 0) {
+		/* Resumed copy: pick up the hash of what is already there */
+		ret = xcp_hash_fd(job->hash, job->ifd, data);
+		if (ret < 0) {
+			job->what = "read";
+			return ret;
+		}
+	}
+	while (data < job->size) {
+		hole = job->size;
+		if (sparse) {
+			off_t pos = lseek(job->ifd, data, SEEK_DATA);
+
+			if (pos < 0 && errno == ENXIO)
+				/* Only a hole remains */
+				break;
+			if (pos < 0) {
+				sparse = false;
+			} else {
+				data = pos;
+				hole = lseek(job->ifd, data, SEEK_HOLE);
+				if (hole < 0 || hole > job->size)
+					hole = job->size;
+			}
+		}
+		if (job->jfd >= 0 && !e->whole &&
+		    hole - data > (off_t)xcp_ckpt_size)
+			hole = data + xcp_ckpt_size;
+		ret = e->copy(job, data, hole - data);
+		if (ret < 0)
+			return ret;
+		if (job->jfd >= 0) {
+			ret = xcp_checkpoint(job, data, hole);
+			if (ret < 0)
+				return ret;
+		}
+		data = hole;
+	}
+	if (job->hash != NULL)
+		xcp_hash_seek(job->hash, job->size);
+
+	if (!job->sparse)
+		return 0;
+	if (ftruncate(job->ofd, job->size) < 0) {
+		job->what = "ftruncate";
+		return -errno;
+	}
+	for (i = 0; i < job->nxfd; ++i) {
+		if (ftruncate(job->xfd[i], job->size) < 0) {
+			job->what = "ftruncate";
+			return -errno;
+		}
+	}
+	return 0;
+}
+
+static int xcp_try(const struct xcp_engine *e, struct xcp_job *job)
+{
+	int ret;
+
+	job->priv = NULL;
+	if (job->nxfd > 0 && !e->fanout) {
+		job->what = "multiple destinations";
+		return -EOPNOTSUPP;
+	}
+	if ((xcp_bwlimit != 0 || xcp_iops_limit != 0) && !e->throttles) {
+		job->what = "--bwlimit/--iops-limit";
+		return -EOPNOTSUPP;
+	}
+	if (job->hash != NULL) {
+		if (!e->hashes) {
+			job->what = "--hash";
+			return -EOPNOTSUPP;
+		}
+		xcp_hash_init(job->hash);
 	}
+	if (e->setup != NULL) {
+		ret = e->setup(job);
+		if (ret < 0)
+			return ret;
+	}
+	ret = xcp_walk(e, job);
+	if (e->teardown != NULL)
+		e->teardown(job);
+	return ret;
+}
+
+/**
+ * xcp_run - copy with the selected engine, falling back as needed
+ *
+ * An explicitly selected engine that turns out to be unsupported falls back
+ * to mmap; --auto walks xcp_auto_order. Returns the engine that did the copy
+ * in *@used.
+ */
+static int xcp_run(const char *arg0, struct xcp_job *job, unsigned int *used)
+{
+	unsigned int i;
+	int ret;
+
+	if (xcp_mode != XCP_AUTO) {
+		*used = xcp_mode;
+		ret = xcp_try(&xcp_engines[xcp_mode], job);
+		if (ret == 0 || job->copied != 0 || !xcp_unsupported(ret) ||
+		    xcp_mode == XCP_MMAP)
+			return ret;
+		fprintf(stderr, "%s: %s unavailable (%s), falling back "
+		        "to mmap\n", arg0, xcp_engines[xcp_mode].name,
+		        strerror(-ret));
+		*used = XCP_MMAP;
+		return xcp_try(&xcp_engines[XCP_MMAP], job);
+	}
+
+	ret = -ENOSYS;
+	for (i = 0; i < ARRAY_SIZE(xcp_auto_order); ++i) {
+		*used = xcp_auto_order[i];
+		ret = xcp_try(&xcp_engines[*used], job);
+		if (ret == 0 || job->copied != 0 || !xcp_unsupported(ret))
+			return ret;
+		if (xcp_verbose)
+			fprintf(stderr, "%s: %s: %s\n", arg0,
+			        xcp_engines[*used].name, strerror(-ret));
+	}
+	return ret;
+}
+
+/**
+ * xcp_xattr_copy - copy extended attributes (and thus ACLs)
+ *
+ * Attributes that the destination filesystem or our privileges do not
+ * permit are silently skipped.
+ */
+static int xcp_xattr_copy(const char *src, const char *dst)
+{
+	char *list = NULL, *name, *value = NULL;
+	ssize_t lsize, vsize;
+	int ret = 0;
+
+	lsize = llistxattr(src, NULL, 0);
+	if (lsize <= 0)
+		return 0;
+	list = malloc(lsize);
+	if (list == NULL)
+		return -errno;
+	lsize = llistxattr(src, list, lsize);
+	for (name = list; lsize > 0 && name < list + lsize;
+	     name += strlen(name) + 1) {
+		vsize = lgetxattr(src, name, NULL, 0);
+		if (vsize < 0)
+			continue;
+		free(value);
+		value = malloc(vsize + 1);
+		if (value == NULL) {
+			ret = -errno;
+			break;
+		}
+		vsize = lgetxattr(src, name, value, vsize);
+		if (vsize < 0)
+			continue;
+		if (lsetxattr(dst, name, value, vsize, 0) < 0 &&
+		    errno != EOPNOTSUPP && errno != EPERM) {
+			fprintf(stderr, "setxattr(\"%s\", %s): %s\n",
+			        dst, name, strerror(errno));
+			ret = -errno;
+		}
+	}
+	free(value);
+	free(list);
+	return ret;
+}
+
+/**
+ * xcp_meta_copy - replicate owner, mode, xattrs and timestamps
+ *
+ * Ownership is only changed when we are allowed to (EPERM is ignored, like
+ * cp -p does for non-root users). Timestamps come last so that nothing
+ * bumps them afterwards.
+ */
+static int xcp_meta_copy(const char *src, const char *dst,
+    const struct stat *sb)
+{
+	const struct timespec ts[2] = {sb->st_atim, sb->st_mtim};
+	int ret = 0;
+
+	if (lchown(dst, sb->st_uid, sb->st_gid) < 0 && errno != EPERM) {
+		fprintf(stderr, "chown(\"%s\"): %s\n", dst, strerror(errno));
+		ret = -errno;
+	}
+	if (!S_ISLNK(sb->st_mode) && chmod(dst, sb->st_mode & 07777) < 0) {
+		fprintf(stderr, "chmod(\"%s\"): %s\n", dst, strerror(errno));
+		ret = -errno;
+	}
+	if (xcp_xattr_copy(src, dst) < 0)
+		ret = -EIO;
+	if (utimensat(AT_FDCWD, dst, ts, AT_SYMLINK_NOFOLLOW) < 0) {
+		fprintf(stderr, "utimensat(\"%s\"): %s\n", dst, strerror(errno));
+		ret = -errno;
+	}
+	return ret;
+}
+
+/**
+ * xcp_verify_dst - re-read the destination and compare against @expect
+ *
+ * O_DIRECT is used so that the data comes from the device rather than from
+ * the page cache that was just filled by the copy.
+ */
+static int xcp_verify_dst(const char *dst, off_t size, const char *expect)
+{
+	struct xcp_hash hash = {.type = xcp_hash_type};
+	char digest[65];
+	int fd, ret;
+
+	fd = open(dst, O_RDONLY | O_DIRECT);
+	if (fd < 0 && errno == EINVAL) {
+		/* Filesystem without O_DIRECT; drop what is cached instead */
+		fd = open(dst, O_RDONLY);
+		if (fd >= 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "open(\"%s\"): %s\n", dst, strerror(errno));
+		return ret;
+	}
+	xcp_hash_init(&hash);
+	ret = xcp_hash_fd(&hash, fd, size);
+	close(fd);
+	if (ret < 0) {
+		fprintf(stderr, "%s: verify: %s\n", dst, strerror(-ret));
+		return ret;
+	}
+	xcp_hash_final(&hash, digest, sizeof(digest));
+	if (strcmp(digest, expect) != 0) {
+		fprintf(stderr, "%s: verification failed (%s, expected %s)\n",
+		        dst, digest, expect);
+		return -EIO;
+	}
+	return 0;
+}
+
+/**
+ * xcp_open_dst - open a destination for xcp_file
+ */
+static int xcp_open_dst(const char *dst)
+{
+	int fd;
+
+	if (strcmp(dst, "-") == 0)
+		fd = dup(STDOUT_FILENO);
+	else
+		fd = open(dst, O_WRONLY | O_CREAT |
+		     (xcp_resume ? 0 : O_TRUNC), S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		fprintf(stderr, "open(\"%s\"): %s\n", dst, strerror(errno));
+	return fd;
+}
+
+/**
+ * xcp_file - copy one regular file
+ * @dst:	destination paths
+ * @ndst:	number of entries in @dst; all of them are written from a
+ * 		single read pass over @src
+ * @preserve:	also copy owner, mode, xattrs and timestamps
+ *
+ * Returns 0 on success or a negative errno; messages have been printed.
+ */
+static int xcp_file(const char *arg0, const char *src,
+    const char *const *dst, unsigned int ndst, bool preserve)
+{
+	struct xcp_hash hash = {.type = xcp_hash_type};
+	struct xcp_job job = {.jfd = -1};
+	struct stat isb, osb;
+	bool to_stdout = false;
+	unsigned int used, i;
+	char digest[65];
+	int *fds, ret;
 
-	while (ioff != isb.st_size) {
-		ret = splice(ifd, &ioff, pfd[1], NULL, isb.st_size, 0);
+	if (xcp_hash_type != XCP_HASH_NONE)
+		job.hash = &hash;
+	fds = malloc(ndst * sizeof(*fds));
+	if (fds == NULL)
+		return -errno;
+	for (i = 0; i < ndst; ++i)
+		fds[i] = -1;
+	job.ifd = open(src, O_RDONLY);
+	if (job.ifd < 0) {
+		ret = -errno;
+		fprintf(stderr, "open(\"%s\"): %s\n", src, strerror(errno));
+		free(fds);
+		return ret;
+	}
+	if (fstat(job.ifd, &isb) < 0) {
+		ret = -errno;
+		perror("fstat");
+		goto out;
+	}
+	job.size   = isb.st_size;
+	job.sparse = true;
+	for (i = 0; i < ndst; ++i) {
+		fds[i] = xcp_open_dst(dst[i]);
+		if (fds[i] < 0) {
+			ret = -errno;
+			goto out;
+		}
+		if (fstat(fds[i], &osb) < 0) {
+			ret = -errno;
+			perror("fstat");
+			goto out;
+		}
+		if (strcmp(dst[i], "-") == 0)
+			to_stdout = true;
+		/* Devices etc. must have the zeroes written out */
+		if (!S_ISREG(osb.st_mode) || strcmp(dst[i], "-") == 0)
+			job.sparse = false;
+		if (lseek(fds[i], 0, SEEK_CUR) < 0 && errno == ESPIPE)
+			job.stream = true;
+	}
+	job.ofd  = fds[0];
+	job.xfd  = fds + 1;
+	job.nxfd = ndst - 1;
+	if (xcp_resume && job.sparse) {
+		ret = xcp_journal_open(&job, *dst, &isb, &osb);
 		if (ret < 0) {
-			perror("splice-in");
-			return EXIT_FAILURE;
+			fprintf(stderr, "%s: %s: %s\n", *dst, job.what,
+			        strerror(-ret));
+			goto out;
+		}
+	}
+
+	ret = xcp_run(arg0, &job, &used);
+	__atomic_add_fetch(&xcp_stats.bytes, job.copied, __ATOMIC_RELAXED);
+	if (ret < 0)
+		fprintf(stderr, "%s: %s: %s: %s\n", arg0, src, job.what,
+		        strerror(-ret));
+	else if (xcp_verbose)
+		fprintf(stderr, "%s: %s: copied using %s\n", arg0, src,
+		        xcp_engines[used].name);
+	if (ret == 0 && job.hash != NULL) {
+		xcp_hash_final(&hash, digest, sizeof(digest));
+		fprintf(to_stdout ? stderr : stdout, "%s  %s\n", digest, src);
+	}
+	for (i = 0; ret == 0 && xcp_verify && i < ndst; ++i) {
+		if (job.stream || to_stdout) {
+			fprintf(stderr, "%s: cannot verify a stream\n", dst[i]);
+			ret = -ESPIPE;
+		} else if (fdatasync(fds[i]) < 0) {
+			ret = -errno;
+			fprintf(stderr, "fdatasync(\"%s\"): %s\n", dst[i],
+			        strerror(errno));
+		} else {
+			ret = xcp_verify_dst(dst[i], isb.st_size, digest);
+		}
+	}
+	for (i = 0; ret == 0 && preserve && i < ndst; ++i)
+		ret = xcp_meta_copy(src, dst[i], &isb);
+ out:
+	if (job.jfd >= 0) {
+		close(job.jfd);
+		/* Done; a new run should not resume anything */
+		if (ret == 0)
+			unlink(job.jpath);
+		free(job.jpath);
+	}
+	close(job.ifd);
+	for (i = 0; i < ndst; ++i) {
+		if (fds[i] >= 0 && close(fds[i]) < 0 && ret == 0) {
+			ret = -errno;
+			perror("close");
+		}
+	}
+	free(fds);
+	return ret;
+}
+
+/**
+ * @src, @dst:	paths for the copy
+ */
+struct xcp_task {
+	char *src, *dst;
+};
+
+/**
+ * A deque of tasks. The owning worker takes from the tail (most recently
+ * queued, likely still in cache), thieves take from the head.
+ */
+struct xcp_queue {
+	pthread_mutex_t lock;
+	struct xcp_task *v;
+	size_t head, tail, alloc;
+};
+
+/**
+ * @arg0:	program name for messages
+ * @q:		one queue per worker
+ * @nr:		number of workers
+ * @lock:	protects @pending, @done, @status
+ * @more:	signalled when a task has been queued or @done is set
+ * @space:	signalled when a task has been taken
+ * @pending:	tasks queued (or about to be) that have not yet been taken
+ * @done:	no more tasks will be queued
+ * @status:	nonzero if any copy failed
+ */
+struct xcp_pool {
+	const char *arg0;
+	struct xcp_queue *q;
+	unsigned int nr, next;
+	pthread_mutex_t lock;
+	pthread_cond_t more, space;
+	size_t pending;
+	bool done;
+	int status;
+};
+
+/* Walker stops queueing once this many tasks per worker are waiting */
+static const size_t xcp_backlog = 1024;
+
+static bool xcp_queue_push(struct xcp_queue *q, char *src, char *dst)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail == q->alloc && q->head > 0) {
+		memmove(q->v, q->v + q->head,
+		        (q->tail - q->head) * sizeof(*q->v));
+		q->tail -= q->head;
+		q->head  = 0;
+	} else if (q->tail == q->alloc) {
+		size_t na = q->alloc == 0 ? 64 : 2 * q->alloc;
+		struct xcp_task *nv = realloc(q->v, na * sizeof(*nv));
+
+		if (nv == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			return false;
+		}
+		q->v     = nv;
+		q->alloc = na;
+	}
+	q->v[q->tail].src = src;
+	q->v[q->tail].dst = dst;
+	++q->tail;
+	pthread_mutex_unlock(&q->lock);
+	return true;
+}
+
+static bool xcp_queue_take(struct xcp_queue *q, struct xcp_task *t, bool steal)
+{
+	bool ret = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*t  = steal ? q->v[q->head++] : q->v[--q->tail];
+		ret = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return ret;
+}
+
+/**
+ * xcp_pool_take - get a task from our own queue, or steal one
+ *
+ * Returns false once the walker is done and nothing is left.
+ */
+static bool xcp_pool_take(struct xcp_pool *pool, unsigned int self,
+    struct xcp_task *t)
+{
+	unsigned int i;
+	bool ret;
+
+	while (true) {
+		ret = xcp_queue_take(&pool->q[self], t, false);
+		for (i = 1; !ret && i < pool->nr; ++i)
+			ret = xcp_queue_take(&pool->q[(self + i) % pool->nr],
+			      t, true);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret) {
+			--pool->pending;
+			pthread_cond_signal(&pool->space);
+			pthread_mutex_unlock(&pool->lock);
+			return true;
+		}
+		while (pool->pending == 0 && !pool->done)
+			pthread_cond_wait(&pool->more, &pool->lock);
+		ret = pool->pending == 0 && pool->done;
+		pthread_mutex_unlock(&pool->lock);
+		if (ret)
+			return false;
+	}
+}
+
+/**
+ * @pool:	pool the worker belongs to
+ * @self:	index of the worker's own queue
+ */
+struct xcp_worker {
+	struct xcp_pool *pool;
+	unsigned int self;
+	pthread_t tid;
+};
+
+static void *xcp_worker_main(void *arg)
+{
+	const struct xcp_worker *w = arg;
+	struct xcp_pool *pool = w->pool;
+	struct xcp_task t;
+
+	while (xcp_pool_take(pool, w->self, &t)) {
+		const char *dst = t.dst;
+
+		if (xcp_file(pool->arg0, t.src, &dst, 1, true) < 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->status = -1;
+			pthread_mutex_unlock(&pool->lock);
 		}
-		ret = splice(pfd[0], NULL, ofd, &ooff, ret, 0);
+		free(t.src);
+		free(t.dst);
+	}
+	return NULL;
+}
+
+/**
+ * xcp_pool_add - queue a file copy, round-robin over the workers
+ *
+ * Takes ownership of @src and @dst. Blocks while the workers are far behind,
+ * so that a huge tree does not end up entirely in memory.
+ */
+static int xcp_pool_add(struct xcp_pool *pool, char *src, char *dst)
+{
+	/*
+	 * Count the task before it becomes visible, so that a worker
+	 * taking it right away cannot drive @pending below zero.
+	 */
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending >= xcp_backlog * pool->nr)
+		pthread_cond_wait(&pool->space, &pool->lock);
+	++pool->pending;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!xcp_queue_push(&pool->q[pool->next], src, dst)) {
+		pthread_mutex_lock(&pool->lock);
+		--pool->pending;
+		pthread_cond_broadcast(&pool->more);
+		pthread_mutex_unlock(&pool->lock);
+		free(src);
+		free(dst);
+		return -ENOMEM;
+	}
+	pool->next = (pool->next + 1) % pool->nr;
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->more);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+/**
+ * xcp_pool_size - pick the number of copy threads
+ *
+ * Copies mostly sleep on I/O, so when the destination device has a deep
+ * request queue, use up to four threads per CPU to keep it filled.
+ */
+static unsigned int xcp_pool_size(const char *dst)
+{
+	static const char *const fmt[] = {
+		"/sys/dev/block/%u:%u/queue/nr_requests",
+		"/sys/dev/block/%u:%u/../queue/nr_requests",
+	};
+	unsigned int nr, depth = 0, i;
+	char path[64];
+	struct stat sb;
+	long cpus;
+	FILE *fp;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr   = cpus < 1 ? 1 : cpus;
+	if (stat(dst, &sb) < 0)
+		return nr;
+	for (i = 0; i < ARRAY_SIZE(fmt) && depth == 0; ++i) {
+		snprintf(path, sizeof(path), fmt[i], major(sb.st_dev),
+		         minor(sb.st_dev));
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+		if (fscanf(fp, "%u", &depth) != 1)
+			depth = 0;
+		fclose(fp);
+	}
+	if (depth > nr)
+		nr = depth < 4 * nr ? depth : 4 * nr;
+	return nr;
+}
+
+/**
+ * @src, @dst:	directory paths
+ * @sb:		source directory's stat
+ */
+struct xcp_dir {
+	char *src, *dst;
+	struct stat sb;
+};
+
+/**
+ * @pool:	where file copies go
+ * @dirs:	directories created, for fixing up their metadata at the end
+ * @skip_dev, @skip_ino:	destination root, in case it is inside the source
+ */
+struct xcp_tree {
+	struct xcp_pool *pool;
+	struct xcp_dir *dirs;
+	size_t nr_dirs, alloc_dirs;
+	dev_t skip_dev;
+	ino_t skip_ino;
+	int status;
+};
+
+static int xcp_tree_special(const char *src, const char *dst,
+    const struct stat *sb)
+{
+	char target[PATH_MAX];
+	ssize_t ret;
+
+	if (S_ISLNK(sb->st_mode)) {
+		ret = readlink(src, target, sizeof(target) - 1);
 		if (ret < 0) {
-			perror("splice-out");
-			return EXIT_FAILURE;
+			fprintf(stderr, "readlink(\"%s\"): %s\n", src,
+			        strerror(errno));
+			return -errno;
+		}
+		target[ret] = '\0';
+		if (symlink(target, dst) < 0) {
+			fprintf(stderr, "symlink(\"%s\"): %s\n", dst,
+			        strerror(errno));
+			return -errno;
 		}
+	} else if (S_ISFIFO(sb->st_mode) || S_ISCHR(sb->st_mode) ||
+	    S_ISBLK(sb->st_mode)) {
+		if (mknod(dst, sb->st_mode & ~07777, sb->st_rdev) < 0) {
+			fprintf(stderr, "mknod(\"%s\"): %s\n", dst,
+			        strerror(errno));
+			return -errno;
+		}
+	} else {
+		fprintf(stderr, "%s: skipping unsupported file type\n", src);
+		return 0;
 	}
+	return xcp_meta_copy(src, dst, sb);
+}
 
-	return EXIT_SUCCESS;
+/**
+ * xcp_tree_walk - create the directory skeleton and queue all files
+ */
+static void xcp_tree_walk(struct xcp_tree *tree, const char *src,
+    const char *dst, const struct stat *dsb)
+{
+	struct xcp_dir *d;
+	struct dirent *de;
+	struct stat sb;
+	DIR *dir;
+
+	if (mkdir(dst, S_IRWXU) < 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir(\"%s\"): %s\n", dst, strerror(errno));
+		tree->status = -1;
+		return;
+	}
+	if (tree->nr_dirs == tree->alloc_dirs) {
+		size_t na = tree->alloc_dirs == 0 ? 64 : 2 * tree->alloc_dirs;
+
+		d = realloc(tree->dirs, na * sizeof(*d));
+		if (d == NULL) {
+			perror("realloc");
+			tree->status = -1;
+			return;
+		}
+		tree->dirs = d;
+		tree->alloc_dirs = na;
+	}
+	d = &tree->dirs[tree->nr_dirs++];
+	d->src = strdup(src);
+	d->dst = strdup(dst);
+	d->sb  = *dsb;
+
+	dir = opendir(src);
+	if (dir == NULL) {
+		fprintf(stderr, "opendir(\"%s\"): %s\n", src, strerror(errno));
+		tree->status = -1;
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		char *s, *t;
+
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		if (asprintf(&s, "%s/%s", src, de->d_name) < 0)
+			break;
+		if (asprintf(&t, "%s/%s", dst, de->d_name) < 0) {
+			free(s);
+			break;
+		}
+		if (lstat(s, &sb) < 0) {
+			fprintf(stderr, "lstat(\"%s\"): %s\n", s,
+			        strerror(errno));
+			tree->status = -1;
+		} else if (S_ISDIR(sb.st_mode)) {
+			if (sb.st_dev != tree->skip_dev ||
+			    sb.st_ino != tree->skip_ino)
+				xcp_tree_walk(tree, s, t, &sb);
+		} else if (S_ISREG(sb.st_mode)) {
+			if (xcp_pool_add(tree->pool, s, t) < 0)
+				tree->status = -1;
+			continue;
+		} else if (xcp_tree_special(s, t, &sb) < 0) {
+			tree->status = -1;
+		}
+		free(s);
+		free(t);
+	}
+	closedir(dir);
 }
 
-static int xcp_mmap(const char *input, const char *output)
+/**
+ * xcp_tree - recursively copy directory @src to @dst
+ *
+ * This thread walks the tree and creates directories, special files and
+ * symlinks itself; regular files are handed to a pool of copy threads.
+ * Directory metadata is applied last, after all files have been written.
+ */
+static int xcp_tree(const char *arg0, const char *src, const char *dst)
 {
-	struct stat isb;
-	int ifd, ofd;
-	void *area;
+	struct xcp_pool pool = {.arg0 = arg0};
+	struct xcp_tree tree = {.pool = &pool};
+	struct xcp_worker *workers;
+	unsigned int i, started;
+	struct stat sb, dsb;
+	size_t j;
 
-	ifd = open(input, O_RDONLY);
-	if (ifd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", input, strerror(errno));
+	if (lstat(src, &sb) < 0) {
+		fprintf(stderr, "lstat(\"%s\"): %s\n", src, strerror(errno));
 		return EXIT_FAILURE;
 	}
-
-	ofd = open(output, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-	if (ofd < 0) {
-		fprintf(stderr, "open(\"%s\"): %s\n", output, strerror(errno));
+	if (!S_ISDIR(sb.st_mode))
+		return xcp_file(arg0, src, &dst, 1, true) < 0 ?
+		       EXIT_FAILURE : EXIT_SUCCESS;
+	if (mkdir(dst, S_IRWXU) < 0 && errno != EEXIST) {
+		fprintf(stderr, "mkdir(\"%s\"): %s\n", dst, strerror(errno));
 		return EXIT_FAILURE;
 	}
-
-	if (fstat(ifd, &isb) < 0) {
-		perror("fstat");
+	if (stat(dst, &dsb) < 0) {
+		fprintf(stderr, "stat(\"%s\"): %s\n", dst, strerror(errno));
 		return EXIT_FAILURE;
 	}
+	tree.skip_dev = dsb.st_dev;
+	tree.skip_ino = dsb.st_ino;
 
-	area = mmap(NULL, isb.st_size, PROT_READ, MAP_SHARED, ifd, 0);
-	if (area == (void *)-1) {
-		perror("mmap");
+	pool.nr = xcp_jobs != 0 ? xcp_jobs : xcp_pool_size(dst);
+	pool.q  = calloc(pool.nr, sizeof(*pool.q));
+	workers = calloc(pool.nr, sizeof(*workers));
+	if (pool.q == NULL || workers == NULL) {
+		perror("calloc");
 		return EXIT_FAILURE;
 	}
-	madvise(area, isb.st_size, MADV_SEQUENTIAL);
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.more, NULL);
+	pthread_cond_init(&pool.space, NULL);
+	for (i = 0; i < pool.nr; ++i)
+		pthread_mutex_init(&pool.q[i].lock, NULL);
+	for (started = 0; started < pool.nr; ++started) {
+		workers[started].pool = &pool;
+		workers[started].self = started;
+		errno = pthread_create(&workers[started].tid, NULL,
+		        xcp_worker_main, &workers[started]);
+		if (errno != 0) {
+			perror("pthread_create");
+			tree.status = -1;
+			break;
+		}
+	}
+	if (xcp_verbose && tree.status == 0)
+		fprintf(stderr, "%s: using %u copy threads\n", arg0, pool.nr);
+
+	if (tree.status == 0)
+		xcp_tree_walk(&tree, src, dst, &sb);
+
+	/* Also reached when not all workers could be started */
+	pthread_mutex_lock(&pool.lock);
+	pool.done = true;
+	pthread_cond_broadcast(&pool.more);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i].tid, NULL);
+
+	/* Innermost first, although directory order does not matter much */
+	for (j = tree.nr_dirs; j-- > 0; ) {
+		struct xcp_dir *d = &tree.dirs[j];
+
+		if (d->src != NULL && d->dst != NULL &&
+		    xcp_meta_copy(d->src, d->dst, &d->sb) < 0)
+			tree.status = -1;
+		free(d->src);
+		free(d->dst);
+	}
+	free(tree.dirs);
+	for (i = 0; i < pool.nr; ++i) {
+		pthread_mutex_destroy(&pool.q[i].lock);
+		free(pool.q[i].v);
+	}
+	free(pool.q);
+	free(workers);
+	pthread_cond_destroy(&pool.space);
+	pthread_cond_destroy(&pool.more);
+	pthread_mutex_destroy(&pool.lock);
+	return tree.status < 0 || pool.status < 0 ?
+	       EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * xcp_bench_fill - create the scratch source for --bench
+ *
+ * The content is pseudo-random so that compressing or deduplicating
+ * filesystems do not skew the results.
+ */
+static int xcp_bench_fill(int fd)
+{
+	static const size_t bufsize = 1 << 20;
+	unsigned long long done = 0, x = 0x9E3779B97F4A7C15ULL;
+	uint64_t *buf;
+	size_t i, n;
+
+	buf = malloc(bufsize);
+	if (buf == NULL)
+		return -errno;
+	while (done < xcp_bench_size) {
+		for (i = 0; i < bufsize / sizeof(*buf); ++i) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+		}
+		n = xcp_bench_size - done < bufsize ?
+		    xcp_bench_size - done : bufsize;
+		if (write(fd, buf, n) != (ssize_t)n) {
+			free(buf);
+			return -errno;
+		}
+		done += n;
+	}
+	free(buf);
+	return fdatasync(fd) < 0 ? -errno : 0;
+}
+
+/**
+ * xcp_bench - time every engine on a scratch file in @dir
+ *
+ * The source is evicted from the page cache before each run, and the
+ * destination is fdatasync'ed within the timed section, so that all
+ * engines pay for the full round trip to the device.
+ */
+static int xcp_bench(const char *arg0, const char *dir)
+{
+	char *src = NULL, *dst = NULL;
+	unsigned long long t0, ns;
+	struct xcp_job job;
+	unsigned int i;
+	int ret, sfd;
 
-	if (write(ofd, area, isb.st_size) != isb.st_size) {
-		perror("write");
+	if (asprintf(&src, "%s/.xcp-bench-XXXXXX", dir) < 0)
+		return EXIT_FAILURE;
+	sfd = mkstemp(src);
+	if (sfd < 0) {
+		fprintf(stderr, "mkstemp(\"%s\"): %s\n", src, strerror(errno));
+		free(src);
 		return EXIT_FAILURE;
 	}
+	if (asprintf(&dst, "%s.out", src) < 0)
+		goto out;
+	ret = xcp_bench_fill(sfd);
+	if (ret < 0) {
+		fprintf(stderr, "%s: creating scratch file: %s\n", arg0,
+		        strerror(-ret));
+		goto out;
+	}
+
+	xcp_stats_on = true;
+	printf("%-16s %10s %10s %10s\n", "mode", "seconds", "MB/s",
+	       "syscalls");
+	for (i = 0; i < ARRAY_SIZE(xcp_engines); ++i) {
+		if (xcp_engines[i].name == NULL)
+			continue;
+		memset(&job, 0, sizeof(job));
+		job.jfd    = -1;
+		job.size   = xcp_bench_size;
+		job.sparse = true;
+		job.ifd    = open(src, O_RDONLY);
+		job.ofd    = open(dst, O_WRONLY | O_CREAT | O_TRUNC,
+		             S_IRUSR | S_IWUSR);
+		if (job.ifd < 0 || job.ofd < 0) {
+			fprintf(stderr, "%s: open: %s\n", arg0, strerror(errno));
+			if (job.ifd >= 0)
+				close(job.ifd);
+			break;
+		}
+		posix_fadvise(job.ifd, 0, 0, POSIX_FADV_DONTNEED);
+		memset(&xcp_stats, 0, sizeof(xcp_stats));
 
-	munmap(area, isb.st_size);
-	close(ifd);
-	close(ofd);
+		t0  = xcp_clock();
+		ret = xcp_try(&xcp_engines[i], &job);
+		if (ret == 0 && fdatasync(job.ofd) < 0)
+			ret = -errno;
+		ns  = xcp_clock() - t0;
+		if (ret < 0)
+			printf("%-16s %s: %s\n", xcp_engines[i].name,
+			       job.what != NULL ? job.what : "error",
+			       strerror(-ret));
+		else
+			printf("%-16s %10.3f %10.1f %10llu\n",
+			       xcp_engines[i].name, ns / 1e9,
+			       job.copied / (ns / 1e9) / 1e6, xcp_stats.calls);
+		posix_fadvise(job.ofd, 0, 0, POSIX_FADV_DONTNEED);
+		close(job.ifd);
+		close(job.ofd);
+		unlink(dst);
+	}
+ out:
+	close(sfd);
+	unlink(src);
+	free(src);
+	free(dst);
 	return EXIT_SUCCESS;
 }
 
 static int main2(int argc, const char **argv)
 {
+	unsigned long long t0;
+	int ret;
+
 	if (!xcp_get_options(&argc, &argv))
 		return EXIT_FAILURE;
-	if (argc != 3) {
+	xcp_crc32c_init();
+	if (xcp_bench_on)
+		return xcp_bench(*argv, argc > 1 ? argv[1] : ".");
+	if (argc < 3) {
 		fprintf(stderr, "%s: Source and destination file required\n",
 		        *argv);
 		return EXIT_FAILURE;
 	}
-
-	if (xcp_mode == XCP_SPLICE)
-		return xcp_splice(argv[1], argv[2]);
-	else if (xcp_mode == XCP_MMAP)
-		return xcp_mmap(argv[1], argv[2]);
-	return EXIT_FAILURE;
+	if (argc > 3 && (xcp_recursive || xcp_resume)) {
+		fprintf(stderr, "%s: -R and --resume take a single "
+		        "destination\n", *argv);
+		return EXIT_FAILURE;
+	}
+	if (xcp_ioprio >= 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+	    xcp_ioprio) < 0) {
+		/* Threads inherit it, so this has to happen first */
+		fprintf(stderr, "%s: ioprio_set: %s\n", *argv, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (xcp_io_max)
+		xcp_set_io_max(*argv, &argv[1], argc - 1);
+	t0 = xcp_clock();
+	if (xcp_recursive)
+		ret = xcp_tree(*argv, argv[1], argv[2]);
+	else
+		ret = xcp_file(*argv, argv[1], &argv[2], argc - 2, false) < 0 ?
+		      EXIT_FAILURE : EXIT_SUCCESS;
+	if (xcp_stats_on)
+		xcp_stats_print(*argv, xcp_clock() - t0);
+	return ret;
 }
 
 int main(int argc, const char **argv)